@@ -63,6 +63,20 @@ public:
 
     pair<string,INT32> *GetTrace() { return trace; }
 
+    // Hash the frames with FNV-1a so that an allocation site can be
+    // identified by a single integer outside of this process
+    //
+    UINT64 Hash() {
+        UINT64 h = 14695981039346656037ULL;
+        for (INT32 i = 0; i < BacktraceParams::maxDepth; i++) {
+            for (size_t j = 0; j < trace[i].first.size(); j++) {
+                h = (h ^ (unsigned char) trace[i].first[j]) * 1099511628211ULL;
+            }
+            h = (h ^ (UINT64) trace[i].second) * 1099511628211ULL;
+        }
+        return h;
+    }
+
     Backtrace &operator=(const Backtrace &b) {
         for (INT32 i = 0; i < BacktraceParams::maxDepth; i++) {
             trace[i].first = b.trace[i].first;
@@ -2,19 +2,13 @@
 # define __EVENT_HPP
 
 #include "backtrace.hpp"
-
-enum EventTypes {
-    E_MALLOC,
-    E_FREE,
-    E_READ,
-    E_WRITE
-};
+#include "record.hpp"
 
 class Event {
 public:
     Event() { }
 
-    Event(char action, void *addr, unsigned int size, unsigned int threadId, unsigned int timestamp) : 
+    Event(char action, void *addr, unsigned int size, unsigned int threadId, uint64_t timestamp) : 
         _action(action), 
         _addr(addr),
         _size(size),
@@ -23,12 +17,13 @@ public:
 
     char _action;
     void *_addr;
-    unsigned int _size, _threadId, _timestamp;
+    unsigned int _size, _threadId;
+    uint64_t _timestamp;
 };
 
 class AllocationEvent : public Event {
 public:
-    AllocationEvent(char action, void *addr, unsigned int size, unsigned int threadId, unsigned int timestamp, Backtrace& backtrace) : 
+    AllocationEvent(char action, void *addr, unsigned int size, unsigned int threadId, uint64_t timestamp, Backtrace& backtrace) : 
         Event(action, addr, size, threadId, timestamp),
         _backtrace(backtrace) { }
 
@@ -37,7 +32,7 @@ public:
 
 class AccessEvent : public Event {
 public:
-    AccessEvent(char action, void *addr, unsigned int size, unsigned int threadId, unsigned int timestamp) : 
+    AccessEvent(char action, void *addr, unsigned int size, unsigned int threadId, uint64_t timestamp) : 
         Event(action, addr, size, threadId, timestamp) { }
 };
 
@@ -0,0 +1,82 @@
+#if !defined(__LATENCY_HPP)
+# define __LATENCY_HPP
+
+#include <iostream>
+#include "pin.H"
+
+#if defined(_MSC_VER)
+# include <intrin.h>
+#endif // _MSC_VER
+
+// Allocation entry points whose calls can be timed with -l
+//
+enum AllocEntries {
+    L_MALLOC,
+    L_FREE,
+    L_CALLOC,
+    L_REALLOC,
+    L_NUM_ENTRIES
+};
+
+namespace LatencyParams {
+    const char *entryNames[L_NUM_ENTRIES] = { "malloc", "free", "calloc", "realloc" };
+    const int numBuckets = 64;
+};
+
+inline UINT64 ReadCycles() {
+#if defined(_MSC_VER)
+    return __rdtsc();
+#else
+    return __builtin_ia32_rdtsc();
+#endif // _MSC_VER
+}
+
+// Calls are bucketed by powers of two: bucket i counts calls that took
+// [2^i, 2^(i+1)) cycles, with bucket 0 also counting calls that took 0
+//
+struct LatencyHistogram {
+    LatencyHistogram() : _count(0), _total(0), _min(~0ULL), _max(0) {
+        for (int i = 0; i < LatencyParams::numBuckets; i++) {
+            _buckets[i] = 0;
+        }
+    }
+
+    VOID Add(UINT64 cycles) {
+        _count++;
+        _total += cycles;
+        _min = cycles < _min ? cycles : _min;
+        _max = cycles > _max ? cycles : _max;
+        int b = 0;
+        while (cycles >>= 1) {
+            b++;
+        }
+        _buckets[b]++;
+    }
+
+    UINT64 _count, _total, _min, _max;
+    UINT64 _buckets[LatencyParams::numBuckets];
+};
+
+std::ostream& operator<<(std::ostream& os, LatencyHistogram& h) {
+    int last = 0;
+    for (int i = 0; i < LatencyParams::numBuckets; i++) {
+        if (h._buckets[i] > 0) {
+            last = i;
+        }
+    }
+    os << "\"count\":" << h._count << "," <<
+          "\"total\":" << h._total << "," <<
+          "\"min\":" << h._min << "," <<
+          "\"max\":" << h._max << "," <<
+          "\"hist\":[";
+    for (int i = 0; i <= last; i++) { // Trailing empty buckets are left out
+        os << h._buckets[i];
+        if (i < last) {
+            os << ",";
+        }
+    }
+    os << "]";
+    return os;
+}
+
+#endif // __LATENCY_HPP
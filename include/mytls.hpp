@@ -2,12 +2,17 @@
 # define __MY_TLS_HPP
 
 #include <list>
+#include <map>
+#include <vector>
+#include <string>
 #include <cstdlib>
 #include <unistd.h>
 #include <fcntl.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include "backtrace.hpp"
+#include "record.hpp"
+#include "latency.hpp"
 
 struct MyTLS {
     MyTLS() {
@@ -16,9 +21,17 @@ struct MyTLS {
         ssize_t err = read(fd, &_seed, sizeof(_seed));
         assert(err != -1);
         close(fd);
+        _overhead = ~0ULL;
     }
 
     std::list<Event*> _eventsList;
+    // With -r or -b, events are kept here instead of in _eventsList.
+    // _sites remembers the backtrace behind each site hash so that it can
+    // be written out at the end.
+    //
+    std::vector<TraceRecord> _records;
+    PIN_LOCK _recordsLock;
+    std::map<UINT64,std::string> _sites;
     size_t _cachedSize;
     Backtrace _cachedBacktrace;
     // It's very important that _geom is signed, since when decrementing
@@ -26,6 +39,15 @@ struct MyTLS {
     //
     ssize_t _geom;
     unsigned int _seed;
+    unsigned int _threadId;
+    // With -l, the site and start of the call in progress for each entry
+    // point, and the cycles spent per (site, entry point) as measured.
+    // _overhead is the smallest cost of HeapShark's own hooks seen so far.
+    //
+    UINT64 _callSite[L_NUM_ENTRIES], _callStart[L_NUM_ENTRIES];
+    UINT64 _calibrationStamp, _overhead;
+    Backtrace _callBacktrace;
+    std::map<std::pair<UINT64,int>,LatencyHistogram> _latencies;
 };
 
 #endif // __MY_TLS_HPP
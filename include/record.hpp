@@ -0,0 +1,76 @@
+#if !defined(__RECORD_HPP)
+# define __RECORD_HPP
+
+#include <string>
+#include <cassert>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+
+enum EventTypes {
+    E_MALLOC,
+    E_FREE,
+    E_READ,
+    E_WRITE
+};
+
+// A TraceRecord is the fixed-size, pointer-free form of an Event. Unlike
+// Event, it can be copied verbatim into shared memory or a file and read
+// back by a process that doesn't link against Pin. Allocation sites are
+// identified by Backtrace::Hash() rather than by the frames themselves.
+// Every process, and every image it execs, has its own address space and
+// its own clock, so addresses and timestamps only mean something within
+// the same _pid and _image.
+//
+struct TraceRecord {
+    TraceRecord() { }
+
+    TraceRecord(char action, uint64_t addr, uint32_t size, uint32_t threadId, uint32_t pid, uint16_t image,
+                uint64_t timestamp, uint64_t site) :
+        _site(site),
+        _addr(addr),
+        _timestamp(timestamp),
+        _size(size),
+        _threadId(threadId),
+        _pid(pid),
+        _image(image),
+        _action(action) { }
+
+    uint64_t _site, _addr, _timestamp;
+    uint32_t _size, _threadId, _pid;
+    uint16_t _image;
+    uint8_t _action;
+};
+
+// Records are only ordered by timestamp. With std::stable_sort, records
+// that share a timestamp keep the order their thread logged them in, so
+// each thread's program order is never reversed.
+//
+inline bool recordCompare(const TraceRecord &r1, const TraceRecord &r2) {
+    return r1._timestamp < r2._timestamp;
+}
+
+// Map a binary trace written with -b into memory. The caller is
+// responsible for munmapping *ptr when *length is nonzero.
+//
+inline void parseRecordsAsArray(std::string pathname, TraceRecord **ptr, size_t *length) {
+    int fd;
+    struct stat statbuf;
+
+    fd = open(pathname.c_str(), O_RDONLY);
+    assert(fd != -1);
+    fstat(fd, &statbuf);
+    *length = statbuf.st_size / sizeof(TraceRecord);
+    *ptr = nullptr;
+    if (*length > 0) {
+        *ptr = (TraceRecord *) mmap(nullptr, statbuf.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        assert(*ptr != MAP_FAILED);
+        madvise(*ptr, statbuf.st_size, MADV_SEQUENTIAL);
+    }
+    close(fd);
+}
+
+#endif // __RECORD_HPP
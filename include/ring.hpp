@@ -0,0 +1,314 @@
+#if !defined(__RING_HPP)
+# define __RING_HPP
+
+#include <string>
+#include <cstdlib>
+#include <unordered_map>
+#include <stdint.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include "record.hpp"
+
+// SharedRing is a bounded multi-producer/single-consumer queue of
+// TraceRecords that lives in a file under /dev/shm so that HeapShark can
+// stream events to an analyzer running in a separate process. Every cell
+// carries a sequence number (Vyukov's bounded queue), so producers only
+// contend on a single compare-and-swap and never need a lock. Nothing
+// in here depends on Pin.
+//
+// Neither side ever waits inside the ring: TryPush and TryPop simply fail
+// when the ring is full or empty, and the caller decides whether to block
+// or drop.
+//
+// Producers register their pid in the header so that the consumer can
+// notice one that died without detaching, and append the backtrace of
+// every new site to /dev/shm/<name>.sites as soon as they see it, so that
+// neither depends on the traced program exiting cleanly.
+//
+namespace RingParams {
+    const uint64_t magic = 0x485352494e473034; // "HSRING04"
+    const size_t cacheLine = 64;
+    const size_t maxProducers = 256; // Producers past this aren't checked for liveness
+};
+
+struct RingHeader {
+    uint64_t _magic, _capacity, _producers, _dropped;
+    char _pad0[RingParams::cacheLine - 4 * sizeof(uint64_t)];
+    // The producer and consumer positions sit on their own cache lines
+    // so that the consumer draining the ring doesn't slow down producers
+    //
+    uint64_t _enqueuePos;
+    char _pad1[RingParams::cacheLine - sizeof(uint64_t)];
+    uint64_t _dequeuePos;
+    char _pad2[RingParams::cacheLine - sizeof(uint64_t)];
+    // Pids of the producers, 0 for a free slot
+    //
+    uint32_t _pids[RingParams::maxProducers];
+};
+
+struct RingCell {
+    uint64_t _seq;
+    TraceRecord _record;
+};
+
+class SharedRing {
+public:
+    // Create (or reinitialize) the ring /dev/shm/<name> with room for at
+    // least capacity records, with pid as its first producer. Returns
+    // nullptr on failure.
+    //
+    static SharedRing *Create(const std::string &name, uint64_t capacity, uint32_t pid) {
+        uint64_t cap = 1;
+        while (cap < capacity) { // Positions are masked, so round up to a power of two
+            cap <<= 1;
+        }
+        size_t length = sizeof(RingHeader) + cap * sizeof(RingCell);
+        int fd = open(Path(name).c_str(), O_RDWR | O_CREAT | O_TRUNC, 0600);
+        if (fd == -1) {
+            return nullptr;
+        }
+        if (ftruncate(fd, length) == -1) {
+            close(fd);
+            return nullptr;
+        }
+        void *base = mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        close(fd);
+        if (base == MAP_FAILED) {
+            return nullptr;
+        }
+        int sitesFd = open(SitesPath(name).c_str(), O_RDWR | O_CREAT | O_TRUNC | O_APPEND, 0600);
+        if (sitesFd == -1) {
+            munmap(base, length);
+            return nullptr;
+        }
+
+        SharedRing *ring = new SharedRing(base, length, sitesFd);
+        RingHeader *h = ring->_header;
+        h->_capacity = cap;
+        h->_producers = 1;
+        h->_dropped = 0;
+        for (size_t i = 0; i < RingParams::maxProducers; i++) {
+            h->_pids[i] = 0;
+        }
+        h->_pids[0] = pid;
+        h->_enqueuePos = 0;
+        h->_dequeuePos = 0;
+        for (uint64_t i = 0; i < cap; i++) {
+            ring->_cells[i]._seq = i;
+        }
+        // Publish the magic number last so that a consumer that attaches
+        // early never sees a half-initialized ring
+        //
+        __atomic_store_n(&(h->_magic), RingParams::magic, __ATOMIC_RELEASE);
+        return ring;
+    }
+
+    // Attach to a ring created by Create. Returns nullptr if the ring
+    // doesn't exist yet or hasn't finished initializing.
+    //
+    static SharedRing *Attach(const std::string &name) {
+        struct stat statbuf;
+        int fd = open(Path(name).c_str(), O_RDWR);
+        if (fd == -1) {
+            return nullptr;
+        }
+        if (fstat(fd, &statbuf) == -1 || (size_t) statbuf.st_size < sizeof(RingHeader)) {
+            close(fd);
+            return nullptr;
+        }
+        void *base = mmap(nullptr, statbuf.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        close(fd);
+        if (base == MAP_FAILED) {
+            return nullptr;
+        }
+        RingHeader *h = (RingHeader *) base;
+        if (__atomic_load_n(&(h->_magic), __ATOMIC_ACQUIRE) != RingParams::magic ||
+                sizeof(RingHeader) + h->_capacity * sizeof(RingCell) != (size_t) statbuf.st_size) {
+            munmap(base, statbuf.st_size);
+            return nullptr;
+        }
+        int sitesFd = open(SitesPath(name).c_str(), O_RDWR | O_CREAT | O_APPEND, 0600);
+        if (sitesFd == -1) {
+            munmap(base, statbuf.st_size);
+            return nullptr;
+        }
+        return new SharedRing(base, statbuf.st_size, sitesFd);
+    }
+
+    static void Unlink(const std::string &name) {
+        unlink(Path(name).c_str());
+        unlink(SitesPath(name).c_str());
+    }
+
+    bool TryPush(const TraceRecord &r) {
+        uint64_t mask = _header->_capacity - 1;
+        uint64_t pos = __atomic_load_n(&(_header->_enqueuePos), __ATOMIC_RELAXED);
+        for (;;) {
+            RingCell *cell = &(_cells[pos & mask]);
+            uint64_t seq = __atomic_load_n(&(cell->_seq), __ATOMIC_ACQUIRE);
+            int64_t dif = (int64_t) seq - (int64_t) pos;
+            if (dif == 0) {
+                // The cell is free, so try to claim it. On failure, pos is
+                // reloaded with the current enqueue position.
+                //
+                if (__atomic_compare_exchange_n(&(_header->_enqueuePos), &pos, pos + 1, true,
+                                                __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                    cell->_record = r;
+                    __atomic_store_n(&(cell->_seq), pos + 1, __ATOMIC_RELEASE);
+                    return true;
+                }
+            } else if (dif < 0) { // The consumer hasn't drained this cell yet
+                return false;
+            } else { // Another producer claimed this cell first
+                pos = __atomic_load_n(&(_header->_enqueuePos), __ATOMIC_RELAXED);
+            }
+        }
+    }
+
+    // Only one consumer may call TryPop at a time
+    //
+    bool TryPop(TraceRecord *r) {
+        uint64_t mask = _header->_capacity - 1;
+        uint64_t pos = _header->_dequeuePos;
+        RingCell *cell = &(_cells[pos & mask]);
+        uint64_t seq = __atomic_load_n(&(cell->_seq), __ATOMIC_ACQUIRE);
+        if (seq != pos + 1) { // Empty, or the producer hasn't finished writing
+            return false;
+        }
+        *r = cell->_record;
+        __atomic_store_n(&(cell->_seq), pos + mask + 1, __ATOMIC_RELEASE);
+        __atomic_store_n(&(_header->_dequeuePos), pos + 1, __ATOMIC_RELAXED);
+        return true;
+    }
+
+    void AddDropped(uint64_t n) { __atomic_fetch_add(&(_header->_dropped), n, __ATOMIC_RELAXED); }
+    uint64_t Dropped() { return __atomic_load_n(&(_header->_dropped), __ATOMIC_RELAXED); }
+
+    // The consumer knows that no more records will arrive once every
+    // producer has detached or died and the ring is empty. A process may
+    // hold several slots, e.g. while it's forking.
+    //
+    void AddProducer(uint32_t pid) {
+        __atomic_fetch_add(&(_header->_producers), 1, __ATOMIC_RELEASE);
+        for (size_t i = 0; i < RingParams::maxProducers; i++) {
+            uint32_t expected = 0;
+            if (__atomic_compare_exchange_n(&(_header->_pids[i]), &expected, pid, false,
+                                            __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+                return;
+            }
+        }
+    }
+
+    void RemoveProducer(uint32_t pid) {
+        for (size_t i = 0; i < RingParams::maxProducers; i++) {
+            uint32_t expected = pid;
+            if (__atomic_compare_exchange_n(&(_header->_pids[i]), &expected, 0, false,
+                                            __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+                break;
+            }
+        }
+        __atomic_fetch_sub(&(_header->_producers), 1, __ATOMIC_RELEASE);
+    }
+
+    // Hand one of from's slots over to to, e.g. to a child once fork has
+    // returned its pid
+    //
+    void ReplaceProducer(uint32_t from, uint32_t to) {
+        for (size_t i = 0; i < RingParams::maxProducers; i++) {
+            uint32_t expected = from;
+            if (__atomic_compare_exchange_n(&(_header->_pids[i]), &expected, to, false,
+                                            __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+                return;
+            }
+        }
+    }
+
+    // Only called by the consumer. Producers that died are detached on
+    // their behalf first. A producer that has exited but hasn't been
+    // reaped by its parent yet still counts as alive.
+    //
+    bool HasProducers() {
+        if (__atomic_load_n(&(_header->_producers), __ATOMIC_ACQUIRE) == 0) {
+            return false;
+        }
+        for (size_t i = 0; i < RingParams::maxProducers; i++) {
+            uint32_t pid = __atomic_load_n(&(_header->_pids[i]), __ATOMIC_ACQUIRE);
+            if (pid == 0 || kill((pid_t) pid, 0) == 0 || errno != ESRCH) {
+                continue;
+            }
+            if (__atomic_compare_exchange_n(&(_header->_pids[i]), &pid, 0, false,
+                                            __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+                __atomic_fetch_sub(&(_header->_producers), 1, __ATOMIC_RELEASE);
+            }
+        }
+        return __atomic_load_n(&(_header->_producers), __ATOMIC_ACQUIRE) != 0;
+    }
+
+    // Producers append one line per site, "<hash> <backtrace>". A single
+    // write with O_APPEND keeps lines from different producers whole.
+    //
+    void AddSite(uint64_t site, const std::string &backtrace) {
+        std::string line = std::to_string(site) + " " + backtrace + "\n";
+        ssize_t err = write(_sitesFd, line.data(), line.size());
+        (void) err; // Sites are only for display, so losing one isn't fatal
+    }
+
+    // Read the sites appended since the last call into sites. Only the
+    // consumer may call this.
+    //
+    void ReadSites(std::unordered_map<uint64_t,std::string> *sites) {
+        char buf[65536];
+        ssize_t n;
+        while ((n = pread(_sitesFd, buf, sizeof(buf), _sitesOffset)) > 0) {
+            _pendingSites.append(buf, n);
+            _sitesOffset += n;
+        }
+        size_t start = 0, end;
+        while ((end = _pendingSites.find('\n', start)) != std::string::npos) {
+            size_t space = _pendingSites.find(' ', start);
+            if (space != std::string::npos && space < end) {
+                (*sites)[strtoull(_pendingSites.c_str() + start, nullptr, 10)] =
+                    _pendingSites.substr(space + 1, end - space - 1);
+            }
+            start = end + 1;
+        }
+        _pendingSites.erase(0, start);
+    }
+
+    uint64_t Capacity() { return _header->_capacity; }
+
+    ~SharedRing() {
+        munmap(_header, _length);
+        close(_sitesFd);
+    }
+
+private:
+    SharedRing(void *base, size_t length, int sitesFd) :
+        _header((RingHeader *) base),
+        _cells((RingCell *) ((char *) base + sizeof(RingHeader))),
+        _length(length),
+        _sitesFd(sitesFd),
+        _sitesOffset(0) { }
+
+    static std::string Path(const std::string &name) {
+        return "/dev/shm/" + name;
+    }
+
+    static std::string SitesPath(const std::string &name) {
+        return "/dev/shm/" + name + ".sites";
+    }
+
+    RingHeader *_header;
+    RingCell *_cells;
+    size_t _length;
+    int _sitesFd;
+    off_t _sitesOffset;
+    std::string _pendingSites;
+};
+
+#endif // __RING_HPP
@@ -15,6 +15,8 @@
 #include <cmath>
 #include <algorithm>
 #include <fstream>
+#include <sstream>
+#include "ring.hpp"
 
 #if defined(_MSC_VER)
 # define LIKELY(x) (x)
@@ -27,17 +29,39 @@
 #if defined(TARGET_MAC)
 # define MALLOC "_malloc"
 # define FREE "_free"
+# define CALLOC "_calloc"
+# define REALLOC "_realloc"
 #else
 # define MALLOC "malloc"
 # define FREE "free"
+# define CALLOC "calloc"
+# define REALLOC "realloc"
 #endif // TARGET_MAC
 
 using namespace std;
 
 namespace HeapSharkParams {
+    static string outputFile, binaryName, ringName;
     static std::ofstream traceFile;
     static double samplingRate;
     static unsigned int maxDepth;
+    static SharedRing *ring;
+    static std::ofstream binaryFile;
+    static bool useRecords;
+    static bool measureLatency;
+    static bool dropWhenFull;
+    static size_t batchSize;
+    static unsigned int flushInterval;
+    static PIN_THREAD_UID flushThreadUid;
+    // Every image of every process writes its own trace. The first image
+    // of the first process writes to the files it was given, images that
+    // were forked add .<pid>, and images that were exec'd add .<pid>.<image>.
+    // parentImage is the image the parent was running when it forked us.
+    //
+    static NATIVE_PID pid, ppid;
+    static unsigned int image, parentImage;
+    static string suffix;
+    static bool finished;
 };
 
 namespace TLSData {
@@ -47,7 +71,18 @@ namespace TLSData {
 };
 
 static AFUNPTR mallocUsableSize;
-static unsigned int curTime;
+static UINT64 curTime;
+
+// Every malloc and free takes a timestamp of its own from a counter shared
+// by all threads. free takes its timestamp before the object is released
+// and malloc after it's been allocated, so a free is always ordered before
+// a malloc that reuses its address, whichever threads they ran on.
+// Accesses only read the counter and share a timestamp with the last
+// malloc or free.
+//
+inline UINT64 NextTimestamp() {
+    return __atomic_fetch_add(&curTime, 1, __ATOMIC_RELAXED);
+}
 
 inline size_t GetNext(unsigned int *seedp, double p) {
     int r = rand_r(seedp); // TODO: use better RNG
@@ -56,16 +91,151 @@ inline size_t GetNext(unsigned int *seedp, double p) {
     return geom;
 }
 
+// Push a thread's batched records into the ring. If the consumer has
+// fallen behind, either wait for it to catch up or drop the rest of
+// the batch and count it
+//
+VOID FlushRecords(MyTLS *tls) {
+    for (size_t i = 0; i < tls->_records.size(); i++) {
+        while (!HeapSharkParams::ring->TryPush(tls->_records[i])) {
+            if (HeapSharkParams::dropWhenFull) {
+                HeapSharkParams::ring->AddDropped(tls->_records.size() - i);
+                tls->_records.clear();
+                return;
+            }
+            PIN_Yield();
+        }
+    }
+    tls->_records.clear();
+}
+
+// With -r, FlushThread may push a thread's batch at any time, so the
+// batch is only touched while holding the thread's _recordsLock
+//
+inline VOID LogRecord(MyTLS *tls, const TraceRecord &r) {
+    if (HeapSharkParams::ring == nullptr) {
+        tls->_records.push_back(r);
+        return;
+    }
+    PIN_GetLock(&(tls->_recordsLock), -1);
+    tls->_records.push_back(r);
+    if (UNLIKELY(tls->_records.size() >= HeapSharkParams::batchSize)) {
+        FlushRecords(tls);
+    }
+    PIN_ReleaseLock(&(tls->_recordsLock));
+}
+
+// Threads that rarely allocate or access memory would otherwise keep a
+// partial batch to themselves for as long as they're quiet, so with -r,
+// every batch is pushed at least every -rf milliseconds
+//
+VOID FlushThread(VOID *arg) {
+    while (!PIN_IsProcessExiting()) {
+        PIN_Sleep(HeapSharkParams::flushInterval);
+        PIN_GetLock(&TLSData::tlsListLock, -1);
+        for (auto it = TLSData::tlsList.begin(); it != TLSData::tlsList.end(); it++) {
+            PIN_GetLock(&((*it)->_recordsLock), -1);
+            FlushRecords(*it);
+            PIN_ReleaseLock(&((*it)->_recordsLock));
+        }
+        PIN_ReleaseLock(&TLSData::tlsListLock);
+    }
+}
+
+VOID StartFlushThread() {
+    if (HeapSharkParams::ring == nullptr || HeapSharkParams::flushInterval == 0) {
+        return;
+    }
+    if (PIN_SpawnInternalThread(FlushThread, nullptr, 0, &HeapSharkParams::flushThreadUid) == INVALID_THREADID) {
+        cerr << "HeapShark: unable to start the flush thread, -rf is ignored" << endl;
+        HeapSharkParams::flushInterval = 0;
+    }
+}
+
+// Pin waits for internal threads to exit before calling Fini
+//
+VOID PrepareForFini(VOID *v) {
+    if (HeapSharkParams::ring != nullptr && HeapSharkParams::flushInterval > 0) {
+        PIN_WaitForThreadTermination(HeapSharkParams::flushThreadUid, PIN_INFINITE_TIMEOUT, nullptr);
+    }
+}
+
+// With -r, new sites are also appended to the ring's sites file right
+// away, so that a consumer can show backtraces for a program that never
+// exits cleanly
+//
+UINT64 AddSite(MyTLS *tls, Backtrace &backtrace) {
+    UINT64 site = backtrace.Hash();
+    if (tls->_sites.find(site) == tls->_sites.end()) {
+        ostringstream os;
+        os << backtrace;
+        tls->_sites[site] = os.str();
+        if (HeapSharkParams::ring != nullptr) {
+            HeapSharkParams::ring->AddSite(site, tls->_sites[site]);
+        }
+    }
+    return site;
+}
+
+// Once the trace has been written out (see FollowChild), there's nowhere
+// left for events to go
+//
+VOID LogAllocation(MyTLS *tls, char action, ADDRINT addr, size_t size, THREADID threadId, UINT64 timestamp, Backtrace &backtrace) {
+    if (UNLIKELY(HeapSharkParams::finished)) {
+        return;
+    }
+    if (!HeapSharkParams::useRecords) {
+        tls->_eventsList.push_back(new AllocationEvent(action, (void *) addr, size, threadId, timestamp, backtrace));
+        return;
+    }
+    LogRecord(tls, TraceRecord(action, addr, size, threadId, HeapSharkParams::pid, HeapSharkParams::image, 
+                               timestamp, AddSite(tls, backtrace)));
+}
+
+inline VOID LogAccess(MyTLS *tls, char action, ADDRINT addr, UINT32 size, THREADID threadId) {
+    if (UNLIKELY(HeapSharkParams::finished)) {
+        return;
+    }
+    UINT64 timestamp = __atomic_load_n(&curTime, __ATOMIC_RELAXED);
+    if (!HeapSharkParams::useRecords) {
+        tls->_eventsList.push_back(new AccessEvent(action, (void *) addr, size, threadId, timestamp));
+        return;
+    }
+    LogRecord(tls, TraceRecord(action, addr, size, threadId, HeapSharkParams::pid, HeapSharkParams::image, 
+                               timestamp, 0));
+}
+
+// Throw away everything a thread has recorded so far
+//
+VOID ResetTLS(MyTLS *tls) {
+    while (!tls->_eventsList.empty()) {
+        delete tls->_eventsList.front();
+        tls->_eventsList.pop_front();
+    }
+    tls->_records.clear();
+    tls->_sites.clear();
+    tls->_latencies.clear();
+}
+
 VOID ThreadStart(THREADID threadId, CONTEXT *ctxt, INT32 flags, VOID *v) {
     MyTLS *tls = new MyTLS;
     assert(PIN_SetThreadData(TLSData::tlsKey, tls, threadId));
     PIN_GetLock(&TLSData::tlsListLock, -1);
     TLSData::tlsList.push_back(tls);
     PIN_ReleaseLock(&TLSData::tlsListLock);
+    tls->_threadId = threadId;
+    PIN_InitLock(&(tls->_recordsLock));
     tls->_geom = (ssize_t) GetNext(&(tls->_seed), HeapSharkParams::samplingRate);
 }
 
-VOID ThreadFini(THREADID threadId, const CONTEXT *ctxt, INT32 code, VOID *v) { }
+VOID ThreadFini(THREADID threadId, const CONTEXT *ctxt, INT32 code, VOID *v) {
+    if (HeapSharkParams::ring != nullptr) {
+        MyTLS *tls = static_cast<MyTLS*>(PIN_GetThreadData(TLSData::tlsKey, threadId));
+        PIN_GetLock(&(tls->_recordsLock), -1);
+        FlushRecords(tls);
+        PIN_ReleaseLock(&(tls->_recordsLock));
+    }
+}
 
 VOID MallocBefore(THREADID threadId, const CONTEXT* ctxt, ADDRINT size) {
     MyTLS *tls = static_cast<MyTLS*>(PIN_GetThreadData(TLSData::tlsKey, threadId));
@@ -78,15 +248,11 @@ VOID MallocAfter(THREADID threadId, ADDRINT retVal) {
         return;
     }
     MyTLS *tls = static_cast<MyTLS*>(PIN_GetThreadData(TLSData::tlsKey, threadId));
-    // No need for atomicity with timestamps. We just need some loose ordering
-    // of events.
-    //
-    tls->_eventsList.push_back(new AllocationEvent(E_MALLOC, (void *) retVal, tls->_cachedSize, threadId, curTime, tls->_cachedBacktrace));
-    curTime++;
+    LogAllocation(tls, E_MALLOC, retVal, tls->_cachedSize, threadId, NextTimestamp(), tls->_cachedBacktrace);
 }
 
 VOID FreeHook(THREADID threadId, const CONTEXT* ctxt, ADDRINT ptr) {
-    if ((void *) ptr == nullptr) {
+    if ((void *) ptr == nullptr && !HeapSharkParams::measureLatency) {
         // We don't need to track frees to null pointers.
         return;
     }
@@ -95,6 +261,15 @@ VOID FreeHook(THREADID threadId, const CONTEXT* ctxt, ADDRINT ptr) {
     MyTLS *tls = static_cast<MyTLS*>(PIN_GetThreadData(TLSData::tlsKey, threadId));
     Backtrace backtrace;
     backtrace.SetTrace(ctxt);
+    // With -l, CallBefore times this call against the same backtrace.
+    // Frees to null pointers are still timed, just not logged.
+    //
+    if (HeapSharkParams::measureLatency) {
+        tls->_callSite[L_FREE] = AddSite(tls, backtrace);
+        if ((void *) ptr == nullptr) {
+            return;
+        }
+    }
     // If mallocUsableSize is valid, then call malloc_usable_size within application
     // to fetch size of object
     // NOTE: malloc_usable_size does not return the same value given to malloc, but
@@ -107,7 +282,67 @@ VOID FreeHook(THREADID threadId, const CONTEXT* ctxt, ADDRINT ptr) {
                                     PIN_PARG(void *), (void *) ptr,
                                     PIN_PARG_END());
     }
-    tls->_eventsList.push_back(new AllocationEvent(E_FREE, (void *) ptr, size, threadId, curTime, backtrace));
+    LogAllocation(tls, E_FREE, ptr, size, threadId, NextTimestamp(), backtrace);
+}
+
+// With -l, every call to an allocation entry point is bracketed by
+// CallBefore + CallStart before it and CallEnd after it. CallBefore and
+// CallStart run back to back, so the gap between them is what it costs
+// Pin to leave one of our hooks and enter the next. The same cost is paid
+// once between CallStart and CallEnd. Calls are recorded as measured, and
+// the smallest gap of the whole run is written out with them so that the
+// same correction can be applied to every call.
+//
+VOID CallBefore(THREADID threadId, const CONTEXT* ctxt, UINT32 entry) {
+    MyTLS *tls = static_cast<MyTLS*>(PIN_GetThreadData(TLSData::tlsKey, threadId));
+    // MallocBefore has already fetched the backtrace for malloc, and
+    // FreeHook has already found the site for free
+    //
+    if (entry == L_MALLOC) {
+        tls->_callSite[entry] = AddSite(tls, tls->_cachedBacktrace);
+    } else if (entry != L_FREE) {
+        tls->_callBacktrace.SetTrace(ctxt);
+        tls->_callSite[entry] = AddSite(tls, tls->_callBacktrace);
+    }
+    tls->_calibrationStamp = ReadCycles();
+}
+
+VOID CallStart(THREADID threadId, UINT32 entry) {
+    UINT64 now = ReadCycles();
+    MyTLS *tls = static_cast<MyTLS*>(PIN_GetThreadData(TLSData::tlsKey, threadId));
+    tls->_overhead = min(tls->_overhead, now - tls->_calibrationStamp);
+    tls->_callStart[entry] = ReadCycles();
+}
+
+VOID CallEnd(THREADID threadId, UINT32 entry) {
+    UINT64 now = ReadCycles();
+    if (UNLIKELY(HeapSharkParams::finished)) {
+        return;
+    }
+    MyTLS *tls = static_cast<MyTLS*>(PIN_GetThreadData(TLSData::tlsKey, threadId));
+    tls->_latencies[make_pair(tls->_callSite[entry], (int) entry)].Add(now - tls->_callStart[entry]);
+}
+
+// CallEnd has to be inserted before any other IPOINT_AFTER hooks so that
+// they aren't counted as part of the call
+//
+VOID InsertCallBefore(RTN rtn, UINT32 entry) {
+    RTN_InsertCall(rtn, IPOINT_BEFORE, (AFUNPTR) CallBefore,
+                   IARG_THREAD_ID,
+                   IARG_CONST_CONTEXT,
+                   IARG_UINT32, entry,
+                   IARG_END);
+    RTN_InsertCall(rtn, IPOINT_BEFORE, (AFUNPTR) CallStart,
+                   IARG_THREAD_ID,
+                   IARG_UINT32, entry,
+                   IARG_END);
+}
+
+VOID InsertCallEnd(RTN rtn, UINT32 entry) {
+    RTN_InsertCall(rtn, IPOINT_AFTER, (AFUNPTR) CallEnd,
+                   IARG_THREAD_ID,
+                   IARG_UINT32, entry,
+                   IARG_END);
 }
 
 VOID ReadsMem(THREADID threadId, ADDRINT addrRead, UINT32 readSize) {
@@ -117,7 +352,7 @@ VOID ReadsMem(THREADID threadId, ADDRINT addrRead, UINT32 readSize) {
         tls->_geom -= readSize;
         return;
     }
-    tls->_eventsList.push_back(new AccessEvent(E_READ, (void *) addrRead, readSize, threadId, curTime));
+    LogAccess(tls, E_READ, addrRead, readSize, threadId);
     // if (UNLIKELY(tls->_eventsList.size() >= MAX_SIZE)) {
     //     WriteEvents(fd, &outputLock, &(tls->_eventsList));
     // }
@@ -130,7 +365,7 @@ VOID WritesMem(THREADID threadId, ADDRINT addrWritten, UINT32 writeSize) {
         tls->_geom -= writeSize;
         return;
     }
-    tls->_eventsList.push_back(new AccessEvent(E_WRITE, (void *) addrWritten, writeSize, threadId, curTime));
+    LogAccess(tls, E_WRITE, addrWritten, writeSize, threadId);
     tls->_geom = (ssize_t) GetNext(&(tls->_seed), HeapSharkParams::samplingRate);
 }
 
@@ -170,6 +405,10 @@ VOID Image(IMG img, VOID* v) {
 					   IARG_CONST_CONTEXT,
 					   IARG_FUNCARG_ENTRYPOINT_VALUE,
 					   0, IARG_END);
+        if (HeapSharkParams::measureLatency) {
+            InsertCallBefore(rtn, L_MALLOC);
+            InsertCallEnd(rtn, L_MALLOC);
+        }
 		RTN_InsertCall(rtn, IPOINT_AFTER, (AFUNPTR) MallocAfter,
 					   IARG_THREAD_ID,
 					   IARG_FUNCRET_EXITPOINT_VALUE,
@@ -187,9 +426,34 @@ VOID Image(IMG img, VOID* v) {
 					   IARG_CONST_CONTEXT,
 					   IARG_FUNCARG_ENTRYPOINT_VALUE,
 					   0, IARG_END);
+        if (HeapSharkParams::measureLatency) {
+            InsertCallBefore(rtn, L_FREE);
+            InsertCallEnd(rtn, L_FREE);
+        }
 		RTN_Close(rtn);
 	}
 
+    // calloc and realloc are only timed, their allocations aren't logged.
+    // If they call malloc, the time spent in malloc's hooks is counted
+    // towards them as well.
+    //
+    if (HeapSharkParams::measureLatency) {
+        rtn = RTN_FindByName(img, CALLOC);
+        if (RTN_Valid(rtn)) {
+            RTN_Open(rtn);
+            InsertCallBefore(rtn, L_CALLOC);
+            InsertCallEnd(rtn, L_CALLOC);
+            RTN_Close(rtn);
+        }
+        rtn = RTN_FindByName(img, REALLOC);
+        if (RTN_Valid(rtn)) {
+            RTN_Open(rtn);
+            InsertCallBefore(rtn, L_REALLOC);
+            InsertCallEnd(rtn, L_REALLOC);
+            RTN_Close(rtn);
+        }
+    }
+
     // Store the function pointer to malloc_usable_size
     //
     rtn = RTN_FindByName(img, mallocUsableSizeFunctionName);
@@ -200,18 +464,117 @@ VOID Image(IMG img, VOID* v) {
     }
 }
 
-VOID Fini(INT32 code, VOID* v) {
+// Write the cycles spent per site, entry point and thread, as measured.
+// overhead is the smallest cost of our own hooks over all threads, which
+// is included once in every call and should be subtracted from each.
+//
+VOID WriteLatency() {
+    UINT64 overhead = ~0ULL;
+    bool first = true;
+    HeapSharkParams::traceFile << "\"latency\":{\"calls\":[";
+    for (auto tls = TLSData::tlsList.begin(); tls != TLSData::tlsList.end(); tls++) {
+        overhead = min(overhead, (*tls)->_overhead);
+        for (auto it = (*tls)->_latencies.begin(); it != (*tls)->_latencies.end(); it++) {
+            if (!first) {
+                HeapSharkParams::traceFile << ",";
+            }
+            first = false;
+            HeapSharkParams::traceFile << "{\"site\":" << it->first.first << 
+                                          ",\"backtrace\":" << (*tls)->_sites[it->first.first] << 
+                                          ",\"entry\":\"" << LatencyParams::entryNames[it->first.second] << 
+                                          "\",\"tid\":" << (*tls)->_threadId << 
+                                          "," << it->second << "}";
+        }
+    }
+    HeapSharkParams::traceFile << "],\"overhead\":" << (first ? 0 : overhead) << "},";
+}
+
+// When events are kept as TraceRecords, they're either streamed to the
+// consumer or written in binary to a separate file, so all that's left to
+// write to the output file is the table of allocation sites (and, when
+// streaming, the number of events that were dropped)
+//
+VOID FiniRecords(bool detach) {
+    if (HeapSharkParams::measureLatency) {
+        WriteLatency();
+    }
+
+    map<UINT64,string> allSites;
+    vector<TraceRecord> allRecords;
+    for (auto it = TLSData::tlsList.begin(); it != TLSData::tlsList.end(); it++) {
+        MyTLS *tls = *it;
+        if (HeapSharkParams::ring != nullptr) {
+            FlushRecords(tls);
+        } else {
+            allRecords.insert(allRecords.end(), tls->_records.begin(), tls->_records.end());
+        }
+        allSites.insert(tls->_sites.begin(), tls->_sites.end());
+        ResetTLS(tls);
+    }
+
+    if (HeapSharkParams::ring == nullptr) {
+        stable_sort(allRecords.begin(), allRecords.end(), recordCompare);
+        HeapSharkParams::binaryFile.write((const char *) allRecords.data(), 
+                                          allRecords.size() * sizeof(TraceRecord));
+        HeapSharkParams::binaryFile.close();
+    }
+
+    HeapSharkParams::traceFile << "\"sites\":[";
+    for (auto it = allSites.begin(); it != allSites.end(); it++) {
+        if (it != allSites.begin()) {
+            HeapSharkParams::traceFile << ",";
+        }
+        HeapSharkParams::traceFile << "{\"site\":" << it->first << 
+                                      ",\"backtrace\":" << it->second << "}";
+    }
+    HeapSharkParams::traceFile << "],";
+    if (HeapSharkParams::ring == nullptr) {
+        HeapSharkParams::traceFile << "\"events\":[]}";
+        return;
+    }
+    HeapSharkParams::traceFile << "\"dropped\":" << 
+                                  HeapSharkParams::ring->Dropped() << 
+                                  ",\"events\":[]}";
+
+    // Let the consumer know that nothing else is coming, unless the next
+    // image is going to carry on streaming in our place
+    //
+    if (!detach) {
+        return;
+    }
+    HeapSharkParams::ring->RemoveProducer(HeapSharkParams::pid);
+    delete HeapSharkParams::ring;
+    HeapSharkParams::ring = nullptr;
+}
+
+// Write out everything this image has recorded. Threads may keep running
+// afterwards (e.g. when execve fails), so their state is cleared rather
+// than freed.
+//
+VOID FiniImage(bool detach) {
+    if (HeapSharkParams::finished) {
+        return;
+    }
+    HeapSharkParams::finished = true;
+    if (HeapSharkParams::useRecords) {
+        FiniRecords(detach);
+        HeapSharkParams::traceFile.close();
+        return;
+    }
+    if (HeapSharkParams::measureLatency) {
+        WriteLatency();
+    }
+
     // Move all events to a single data structure and sort them by time
     //
     list<Event*> allEvents;
-    while (!TLSData::tlsList.empty()) {
-        list<Event*> *curList = &(TLSData::tlsList.front()->_eventsList);
+    for (auto tls = TLSData::tlsList.begin(); tls != TLSData::tlsList.end(); tls++) {
+        list<Event*> *curList = &((*tls)->_eventsList);
         while (!curList->empty()) {
             allEvents.push_back(curList->front());
             curList->pop_front();
         }
-        delete TLSData::tlsList.front();
-        TLSData::tlsList.pop_front();
+        ResetTLS(*tls);
     }
     allEvents.sort(eventCompare);
 
@@ -229,6 +592,20 @@ VOID Fini(INT32 code, VOID* v) {
         allEvents.pop_front();
     }
     HeapSharkParams::traceFile << "]}";
+    HeapSharkParams::traceFile.close();
+}
+
+VOID Fini(INT32 code, VOID* v) {
+    // If FollowChild already wrote the trace but execve failed, all that's
+    // left is to detach from the ring
+    //
+    if (HeapSharkParams::finished) {
+        if (HeapSharkParams::ring != nullptr) {
+            HeapSharkParams::ring->RemoveProducer(HeapSharkParams::pid);
+        }
+        return;
+    }
+    FiniImage(true);
 }
 
 INT32 Usage() {
@@ -244,12 +621,162 @@ void Fatal(string errMsg) {
     PIN_ExitProcess(1);
 }
 
+string FollowMarker(NATIVE_PID pid) {
+    ostringstream os;
+    os << HeapSharkParams::outputFile << "." << pid << ".follow";
+    return os.str();
+}
+
+VOID OpenOutputs() {
+    string outputFile = HeapSharkParams::outputFile + HeapSharkParams::suffix;
+    HeapSharkParams::traceFile.open(outputFile.c_str());
+    if (!HeapSharkParams::traceFile) {
+        Fatal("Unable to open " + outputFile);
+    }
+    HeapSharkParams::traceFile.setf(ios::showbase);
+    if (HeapSharkParams::binaryName != "") {
+        string binaryFile = HeapSharkParams::binaryName + HeapSharkParams::suffix;
+        HeapSharkParams::binaryFile.open(binaryFile.c_str(), ios::out | ios::binary);
+        if (!HeapSharkParams::binaryFile) {
+            Fatal("Unable to open " + binaryFile);
+        }
+    }
+}
+
+VOID WriteMetadata() {
+    // TODO: JSON formatting is a headache when it's not all done in one place...
+    //
+    HeapSharkParams::traceFile << "{\"metadata\":{\"samplingRate\":" << 
+                  HeapSharkParams::samplingRate << 
+                  ",\"maxDepth\":" << 
+                  HeapSharkParams::maxDepth << 
+                  ",\"measureLatency\":" << 
+                  HeapSharkParams::measureLatency << 
+                  ",\"pid\":" << 
+                  HeapSharkParams::pid << 
+                  ",\"ppid\":" << 
+                  HeapSharkParams::ppid << 
+                  ",\"image\":" << 
+                  HeapSharkParams::image << 
+                  ",\"parentImage\":" << 
+                  HeapSharkParams::parentImage;
+    if (HeapSharkParams::ring != nullptr) {
+        HeapSharkParams::traceFile << ",\"ring\":\"" << HeapSharkParams::ringName << 
+                      "\",\"dropWhenFull\":" << HeapSharkParams::dropWhenFull;
+    } else if (HeapSharkParams::useRecords) {
+        HeapSharkParams::traceFile << ",\"binary\":\"" << 
+                      HeapSharkParams::binaryName + HeapSharkParams::suffix << "\"";
+    }
+    HeapSharkParams::traceFile << "},";
+}
+
+// Hold the lock on the TLS list across fork so that the child doesn't
+// inherit it half-updated, and flush the output file so that the child
+// doesn't inherit our buffered output either. The child is counted as a
+// producer before it exists, otherwise the parent could detach and the
+// consumer could stop before the child got to announce itself. Until
+// fork returns the child's pid, its slot carries ours.
+//
+VOID ForkBefore(THREADID threadId, const CONTEXT *ctxt, VOID *v) {
+    PIN_GetLock(&TLSData::tlsListLock, -1);
+    HeapSharkParams::traceFile.flush();
+    if (HeapSharkParams::ring != nullptr) {
+        HeapSharkParams::ring->AddProducer(HeapSharkParams::pid);
+    }
+}
+
+VOID ForkAfterInParent(THREADID threadId, const CONTEXT *ctxt, VOID *v) {
+    // fork returns a negative errno when no child was created
+    //
+    ADDRDELTA child = (ADDRDELTA) PIN_GetContextReg(ctxt, REG_GAX);
+    if (HeapSharkParams::ring != nullptr) {
+        if (child < 0) {
+            HeapSharkParams::ring->RemoveProducer(HeapSharkParams::pid);
+        } else {
+            HeapSharkParams::ring->ReplaceProducer(HeapSharkParams::pid, child);
+        }
+    }
+    PIN_ReleaseLock(&TLSData::tlsListLock);
+}
+
+VOID ForkAfterInChild(THREADID threadId, const CONTEXT *ctxt, VOID *v) {
+    MyTLS *tls = static_cast<MyTLS*>(PIN_GetThreadData(TLSData::tlsKey, threadId));
+    PIN_InitLock(&TLSData::tlsListLock);
+
+    // Only the thread that called fork exists in the child. The state of
+    // the other threads is abandoned rather than freed, since they may
+    // have been in the middle of updating it.
+    //
+    TLSData::tlsList.clear();
+    TLSData::tlsList.push_back(tls);
+    ResetTLS(tls);
+    PIN_InitLock(&(tls->_recordsLock));
+
+    HeapSharkParams::ppid = HeapSharkParams::pid;
+    HeapSharkParams::pid = PIN_GetPid();
+    HeapSharkParams::parentImage = HeapSharkParams::image;
+    HeapSharkParams::image = 0;
+    HeapSharkParams::finished = false;
+    ostringstream os;
+    os << "." << HeapSharkParams::pid;
+    HeapSharkParams::suffix = os.str();
+
+    HeapSharkParams::traceFile.close();
+    if (HeapSharkParams::binaryFile.is_open()) {
+        HeapSharkParams::binaryFile.close();
+    }
+    OpenOutputs();
+    WriteMetadata();
+
+    // Internal threads don't survive fork either
+    //
+    StartFlushThread();
+}
+
+// execve replaces the image without calling Fini, so write out the trace
+// now and leave a marker so that the next image knows which process it
+// belongs to. execvp may call execve several times before one succeeds,
+// so this has to be safe to repeat. If execve fails, the image carries on
+// without recording anything else.
+//
+// Other threads are still running until execve succeeds, so they're
+// stopped while their state is written out and cleared.
+//
+BOOL FollowChild(CHILD_PROCESS childProcess, VOID *v) {
+    THREADID threadId = PIN_ThreadId();
+    ofstream marker(FollowMarker(HeapSharkParams::pid).c_str());
+    marker << HeapSharkParams::ppid << " " << HeapSharkParams::parentImage << " " << 
+              HeapSharkParams::image + 1 << endl;
+    marker.close();
+    if (HeapSharkParams::finished) {
+        return TRUE;
+    }
+    if (!PIN_StopApplicationThreads(threadId)) {
+        cerr << "HeapShark: unable to stop threads before execve, trace of image " << 
+                HeapSharkParams::image << " is lost" << endl;
+        HeapSharkParams::finished = true;
+        return TRUE;
+    }
+    PIN_GetLock(&TLSData::tlsListLock, -1);
+    FiniImage(false);
+    PIN_ReleaseLock(&TLSData::tlsListLock);
+    PIN_ResumeApplicationThreads(threadId);
+    return TRUE;
+}
+
 int main(int argc, char* argv[]) {
     // Declare configurable HeapShark parameters
     //
     const string defaultOutputFile = "heapshark.json", 
                  defaultSamplingRate = "0", 
-                 defaultMaxDepth = "3";
+                 defaultMaxDepth = "3",
+                 defaultBinaryFile = "",
+                 defaultRingName = "",
+                 defaultRingCapacity = "1048576",
+                 defaultBatchSize = "4096",
+                 defaultDropWhenFull = "0",
+                 defaultFlushInterval = "1000",
+                 defaultMeasureLatency = "0";
     KNOB<string> knobOutputFile(KNOB_MODE_WRITEONCE, "pintool", "o", 
                                     defaultOutputFile, 
                                     "Output file");
@@ -259,6 +786,27 @@ int main(int argc, char* argv[]) {
     KNOB<unsigned int> knobMaxDepth(KNOB_MODE_WRITEONCE, "pintool", "d", 
                                     defaultMaxDepth, 
                                     "Maximum number of frames to stores in backtraces");
+    KNOB<string> knobBinaryFile(KNOB_MODE_WRITEONCE, "pintool", "b", 
+                                    defaultBinaryFile, 
+                                    "Write events in binary to this file instead of the output file");
+    KNOB<string> knobRingName(KNOB_MODE_WRITEONCE, "pintool", "r", 
+                                    defaultRingName, 
+                                    "Stream events to the shared-memory ring /dev/shm/<name> instead of the output file");
+    KNOB<unsigned int> knobRingCapacity(KNOB_MODE_WRITEONCE, "pintool", "rc", 
+                                    defaultRingCapacity, 
+                                    "Number of events the ring can hold");
+    KNOB<unsigned int> knobBatchSize(KNOB_MODE_WRITEONCE, "pintool", "rb", 
+                                    defaultBatchSize, 
+                                    "Number of events each thread buffers before pushing them into the ring");
+    KNOB<bool> knobDropWhenFull(KNOB_MODE_WRITEONCE, "pintool", "rd", 
+                                    defaultDropWhenFull, 
+                                    "Drop events instead of blocking when the ring is full");
+    KNOB<unsigned int> knobFlushInterval(KNOB_MODE_WRITEONCE, "pintool", "rf", 
+                                    defaultFlushInterval, 
+                                    "Milliseconds between pushes of partly filled batches into the ring (0 to wait for full batches)");
+    KNOB<bool> knobMeasureLatency(KNOB_MODE_WRITEONCE, "pintool", "l", 
+                                    defaultMeasureLatency, 
+                                    "Measure the cycles spent in each call to malloc, free, calloc and realloc");
 
     // Initialize Pin and parse arguments
     //
@@ -269,10 +817,16 @@ int main(int argc, char* argv[]) {
 
     // Initialize HeapShark parameters
     //
-    HeapSharkParams::traceFile.open(knobOutputFile.Value().c_str());
-    HeapSharkParams::traceFile.setf(ios::showbase);
+    HeapSharkParams::outputFile = knobOutputFile.Value();
+    HeapSharkParams::ringName = knobRingName.Value();
     HeapSharkParams::samplingRate = knobSamplingRate.Value();
     HeapSharkParams::maxDepth = knobMaxDepth.Value();
+    HeapSharkParams::ring = nullptr;
+    HeapSharkParams::dropWhenFull = knobDropWhenFull.Value();
+    HeapSharkParams::batchSize = knobBatchSize.Value();
+    HeapSharkParams::flushInterval = knobFlushInterval.Value();
+    HeapSharkParams::measureLatency = knobMeasureLatency.Value();
+    HeapSharkParams::finished = false;
 
     // Check parameters for validity
     //
@@ -282,14 +836,56 @@ int main(int argc, char* argv[]) {
     if (HeapSharkParams::maxDepth > 256) {
         Fatal("Maximum number of frames cannot exceed 256");
     }
+    if (HeapSharkParams::batchSize == 0) {
+        Fatal("Batch size must be greater than 0");
+    }
+    if (HeapSharkParams::measureLatency && HeapSharkParams::samplingRate > 0) {
+        Fatal("Latency can't be measured (-l) while sampling memory accesses (-s), which would be counted towards the calls");
+    }
+    if (HeapSharkParams::ringName != "" && knobBinaryFile.Value() != "") {
+        Fatal("Events can either be streamed to a ring (-r) or written to a binary file (-b), not both");
+    }
     BacktraceParams::maxDepth = HeapSharkParams::maxDepth;
 
-    // TODO: JSON formatting is a headache when it's not all done in one place...
+    // If this image was started by an execve that FollowChild saw, carry
+    // on where the previous image left off
     //
-    HeapSharkParams::traceFile << "{\"metadata\":{\"samplingRate\":" << 
-                  HeapSharkParams::samplingRate << 
-                  ",\"maxDepth\":" << 
-                  HeapSharkParams::maxDepth << "},";
+    HeapSharkParams::pid = PIN_GetPid();
+    ifstream marker(FollowMarker(HeapSharkParams::pid).c_str());
+    if (marker >> HeapSharkParams::ppid >> HeapSharkParams::parentImage >> HeapSharkParams::image) {
+        ostringstream os;
+        os << "." << HeapSharkParams::pid << "." << HeapSharkParams::image;
+        HeapSharkParams::suffix = os.str();
+        marker.close();
+        unlink(FollowMarker(HeapSharkParams::pid).c_str());
+    } else {
+        HeapSharkParams::ppid = getppid();
+        HeapSharkParams::parentImage = 0;
+        HeapSharkParams::image = 0;
+        HeapSharkParams::suffix = "";
+    }
+
+    // An exec'd image takes over the previous image's place in the ring
+    // instead of creating a new one
+    //
+    if (HeapSharkParams::ringName != "") {
+        if (HeapSharkParams::image > 0) {
+            HeapSharkParams::ring = SharedRing::Attach(HeapSharkParams::ringName);
+        }
+        if (HeapSharkParams::ring == nullptr) {
+            HeapSharkParams::ring = SharedRing::Create(HeapSharkParams::ringName, knobRingCapacity.Value(), 
+                                                       HeapSharkParams::pid);
+        }
+        if (HeapSharkParams::ring == nullptr) {
+            Fatal("Unable to create ring /dev/shm/" + HeapSharkParams::ringName);
+        }
+    } else {
+        HeapSharkParams::binaryName = knobBinaryFile.Value();
+    }
+    OpenOutputs();
+    HeapSharkParams::useRecords = HeapSharkParams::ring != nullptr || 
+                                  HeapSharkParams::binaryFile.is_open();
+    WriteMetadata();
 
     // Initialize TLS related data
     //
@@ -310,6 +906,12 @@ int main(int argc, char* argv[]) {
 	PIN_AddThreadStartFunction(ThreadStart, 0);
 	PIN_AddThreadFiniFunction(ThreadFini, 0);
 	PIN_AddFiniFunction(Fini, 0);
+    PIN_AddPrepareForFiniFunction(PrepareForFini, 0);
+    PIN_AddForkFunction(FPOINT_BEFORE, ForkBefore, 0);
+    PIN_AddForkFunction(FPOINT_AFTER_IN_PARENT, ForkAfterInParent, 0);
+    PIN_AddForkFunction(FPOINT_AFTER_IN_CHILD, ForkAfterInChild, 0);
+    PIN_AddFollowChildProcessFunction(FollowChild, 0);
+    StartFlushThread();
 
     // Begin program
     //
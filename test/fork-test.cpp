@@ -0,0 +1,113 @@
+#include <iostream>
+#include <string>
+#include <cstdlib>
+#include <unistd.h>
+#include <sys/wait.h>
+
+inline void *ec_malloc(size_t size) {
+    void *ptr = malloc(size);
+    if (ptr == nullptr) {
+        std::cerr << "fork-test ERROR: malloc failed" << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    return ptr;
+}
+
+// Using custom memset here because regular memset doesn't
+// trigger coverage quite right
+//
+inline void my_memset(void *ptr, size_t size) {
+    for (int i = 0; i < size; i++) {
+        *((char *) ptr + i) = 'a';
+    }
+}
+
+void routine(const int NUM_ITERS, const int OBJ_SIZE) {
+    void *ptr;
+    for (int i = 0; i < NUM_ITERS; i++) {
+        ptr = ec_malloc(OBJ_SIZE);
+        my_memset(ptr, OBJ_SIZE);
+        free(ptr);
+    }
+}
+
+void ec_wait(pid_t pid) {
+    int status;
+    if (waitpid(pid, &status, 0) == -1 || !WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS) {
+        std::cerr << "fork-test ERROR: child " << pid << " failed" << std::endl;
+        exit(EXIT_FAILURE);
+    }
+}
+
+pid_t ec_fork() {
+    pid_t pid = fork();
+    if (pid == -1) {
+        std::cerr << "fork-test ERROR: fork failed" << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    return pid;
+}
+
+// The exec'd image forks a child of its own so that the test can check
+// that the child names image 1 as its parent's image
+//
+int exec_main(const int NUM_ITERS, const int OBJ_SIZE) {
+    routine(NUM_ITERS, OBJ_SIZE);
+    pid_t pid = ec_fork();
+    if (pid == 0) {
+        routine(NUM_ITERS, OBJ_SIZE);
+        exit(EXIT_SUCCESS);
+    }
+    ec_wait(pid);
+    return 0;
+}
+
+// The first worker tries to execvp a binary that doesn't exist, then
+// execs this test again in exec mode. argv[0] has to contain a slash,
+// e.g. ./fork-test, since execvp would otherwise search the PATH.
+//
+void exec_worker(char *argv[], const int NUM_ITERS, const int OBJ_SIZE) {
+    routine(NUM_ITERS, OBJ_SIZE);
+    char missing[] = "./fork-test-does-not-exist";
+    char *missingArgs[] = { missing, nullptr };
+    execvp(missing, missingArgs);
+    char mode[] = "exec";
+    char *execArgs[] = { argv[0], mode, argv[2], argv[3], nullptr };
+    execvp(argv[0], execArgs);
+    std::cerr << "fork-test ERROR: execvp failed" << std::endl;
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[]) {
+    if (argc == 4 && std::string(argv[1]) == "exec") {
+        return exec_main(std::stoi(argv[2]), std::stoi(argv[3]));
+    }
+    if (argc != 4) {
+        std::cerr << "usage: <num_workers> <num_iters> <obj_size>" << std::endl;
+        return EXIT_FAILURE;
+    }
+    const int NUM_WORKERS = std::stoi(argv[1]), NUM_ITERS = std::stoi(argv[2]), OBJ_SIZE = std::stoi(argv[3]);
+    if (NUM_WORKERS < 1) {
+        std::cerr << "fork-test ERROR: need at least one worker" << std::endl;
+        return EXIT_FAILURE;
+    }
+    pid_t *workers = new pid_t[NUM_WORKERS];
+    std::cout << "Starting test..." << std::endl;
+    for (int i = 0; i < NUM_WORKERS; i++) {
+        workers[i] = ec_fork();
+        if (workers[i] == 0) {
+            if (i == 0) {
+                exec_worker(argv, NUM_ITERS, OBJ_SIZE);
+            }
+            routine(NUM_ITERS, OBJ_SIZE);
+            exit(EXIT_SUCCESS);
+        }
+    }
+    routine(NUM_ITERS, OBJ_SIZE);
+    for (int i = 0; i < NUM_WORKERS; i++) {
+        ec_wait(workers[i]);
+    }
+    delete[] workers;
+    std::cout << "Ending test..." << std::endl;
+    return 0;
+}
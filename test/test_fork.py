@@ -0,0 +1,50 @@
+import glob
+import json
+import os
+import sys
+
+# Run from the src directory with
+#   pin -follow_execv -t obj-intel64/heapshark.so -- ../test/fork-test <num_workers> <num_iters> <obj_size>
+# then pass the number of workers to this script
+#
+json_file = '../src/heapshark.json'
+num_workers = int(sys.argv[1]) if len(sys.argv) > 1 else 4
+
+def load(path):
+    with open(path, 'r') as f:
+        return json.load(f)['metadata']
+
+root = load(json_file)
+assert root['image'] == 0 and root['parentImage'] == 0, 'root is not image 0'
+
+traces = {}
+for path in glob.glob(json_file + '.*'):
+    suffix = path[len(json_file) + 1:].split('.')
+    assert suffix[-1] != 'follow', 'marker ' + path + ' was left behind'
+    m = load(path)
+    assert str(m['pid']) == suffix[0], path + ' has the wrong pid'
+    assert m['image'] == (int(suffix[1]) if len(suffix) > 1 else 0), path + ' has the wrong image'
+    traces[(m['pid'], m['image'])] = m
+
+# Every worker writes <output>.<pid>, one of them also <output>.<pid>.1
+# after its failed and successful execvp, and that image's child writes
+# <output>.<pid> naming image 1 as its parent's image
+#
+workers = [m for m in traces.values() if m['image'] == 0 and m['ppid'] == root['pid']]
+assert len(workers) == num_workers, 'expected %d workers, found %d' % (num_workers, len(workers))
+assert all(m['parentImage'] == 0 for m in workers), 'worker has the wrong parentImage'
+
+execs = [m for m in traces.values() if m['image'] > 0]
+assert len(execs) == 1, 'expected one exec\'d image, found %d' % len(execs)
+e = execs[0]
+assert e['image'] == 1, 'failed execvp counted as an image'
+assert (e['pid'], 0) in traces, 'exec\'d image has no trace from before execvp'
+assert e['ppid'] == root['pid'] and e['parentImage'] == 0, 'exec\'d image lost its parent'
+
+children = [m for m in traces.values() if m['ppid'] == e['pid']]
+assert len(children) == 1, 'expected one child of the exec\'d image, found %d' % len(children)
+assert children[0]['parentImage'] == 1, 'child of the exec\'d image has the wrong parentImage'
+
+assert len(traces) == num_workers + 2, 'unexpected traces'
+
+print('YAY!')
@@ -0,0 +1,606 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <map>
+#include <set>
+#include <thread>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+#include <unordered_map>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "record.hpp"
+
+// allocsim replays the malloc/free sequence of a binary trace (written
+// by HeapShark with -b) through models of different allocator designs
+// and reports how much memory each of them would have needed:
+//
+//  seg      size-class segregated slabs
+//  tcache   the same, with per-thread caches of freed objects in front
+//  bump     per-thread bump arenas that are reset once every object in
+//           them has been freed
+//  bestfit  a single heap with best-fit placement and coalescing
+//
+// Footprint is the number of bytes the model holds from the OS. Internal
+// fragmentation is the difference between what objects occupy and what
+// was requested, external fragmentation is what the model holds that
+// isn't occupied by any object, and page utilization is the fraction of
+// the footprint that was requested.
+//
+
+namespace SimParams {
+    const uint64_t pageSize = 4096;
+    const uint64_t alignment = 16;
+    const uint32_t none = UINT32_MAX;
+};
+
+inline uint64_t RoundUp(uint64_t n, uint64_t to) {
+    return (n + to - 1) / to * to;
+}
+
+// An Op is a malloc or free whose object has been replaced with a dense
+// id, so that models can keep per-object state in vectors rather than
+// hash tables
+//
+struct Op {
+    uint32_t _id, _threadId;
+    bool _free;
+};
+
+struct Sample {
+    size_t _op;
+    uint64_t _requested, _allocated, _footprint;
+};
+
+class Model {
+public:
+    Model(std::string name, const std::vector<uint32_t> &sizes) :
+        _name(name),
+        _sizes(sizes),
+        _requested(0),
+        _allocated(0),
+        _footprint(0),
+        _peakFootprint(0),
+        _peakRequested(0),
+        _requestedAtPeak(0),
+        _allocatedAtPeak(0),
+        _utilizationSum(0),
+        _numSamples(0) { }
+
+    virtual ~Model() { }
+
+    virtual void Malloc(uint32_t id, uint32_t size, uint32_t threadId) = 0;
+    virtual void Free(uint32_t id, uint32_t size, uint32_t threadId) = 0;
+
+    // Sample the model every interval ops. Samples are only kept when
+    // timeline is true, but they always count towards average utilization.
+    //
+    void Run(const std::vector<Op> &ops, size_t interval, bool timeline) {
+        for (size_t i = 0; i < ops.size(); i++) {
+            const Op &op = ops[i];
+            uint32_t size = _sizes[op._id];
+            if (op._free) {
+                _requested -= size;
+                Free(op._id, size, op._threadId);
+            } else {
+                _requested += size;
+                Malloc(op._id, size, op._threadId);
+            }
+            if (_footprint > _peakFootprint) {
+                _peakFootprint = _footprint;
+                _requestedAtPeak = _requested;
+                _allocatedAtPeak = _allocated;
+            }
+            _peakRequested = std::max(_peakRequested, _requested);
+            if (i % interval == 0 && _footprint > 0) {
+                _utilizationSum += (double) _requested / _footprint;
+                _numSamples++;
+                if (timeline) {
+                    Sample s = { i, _requested, _allocated, _footprint };
+                    _timeline.push_back(s);
+                }
+            }
+        }
+    }
+
+    std::string _name;
+    const std::vector<uint32_t> &_sizes;
+    uint64_t _requested, _allocated, _footprint;
+    uint64_t _peakFootprint, _peakRequested, _requestedAtPeak, _allocatedAtPeak;
+    double _utilizationSum;
+    size_t _numSamples;
+    std::vector<Sample> _timeline;
+};
+
+class SegregatedModel : public Model {
+public:
+    // Objects larger than the largest class are given their own pages.
+    // With cacheLimit > 0, each thread keeps up to cacheLimit freed objects
+    // per class, and returns half of them to their slabs when it overflows.
+    //
+    SegregatedModel(std::string name, const std::vector<uint32_t> &sizes,
+                    const std::vector<uint32_t> &classes, uint64_t slabSize, size_t cacheLimit) :
+        Model(name, sizes),
+        _cacheLimit(cacheLimit),
+        _maxClass(classes.back()),
+        _classIndex(classes.back() + 1),
+        _objSlab(sizes.size(), SimParams::none) {
+        size_t c = 0;
+        for (uint32_t s = 0; s <= _maxClass; s++) {
+            while (classes[c] < s) {
+                c++;
+            }
+            _classIndex[s] = c;
+        }
+        for (size_t i = 0; i < classes.size(); i++) {
+            SizeClass sc;
+            sc._size = classes[i];
+            sc._slabBytes = RoundUp(std::max(slabSize, (uint64_t) classes[i]), SimParams::pageSize);
+            sc._perSlab = sc._slabBytes / classes[i];
+            _classes.push_back(sc);
+        }
+    }
+
+    void Malloc(uint32_t id, uint32_t size, uint32_t threadId) {
+        if (size > _maxClass) {
+            uint64_t large = RoundUp(size, SimParams::pageSize);
+            _footprint += large;
+            _allocated += large;
+            return;
+        }
+        uint32_t c = _classIndex[size];
+        _allocated += _classes[c]._size;
+        if (_cacheLimit > 0) {
+            std::vector<uint32_t> &cache = Cache(threadId, c);
+            if (!cache.empty()) {
+                _objSlab[id] = cache.back();
+                cache.pop_back();
+                return;
+            }
+        }
+        _objSlab[id] = TakeSlot(c);
+    }
+
+    void Free(uint32_t id, uint32_t size, uint32_t threadId) {
+        uint32_t s = _objSlab[id];
+        if (s == SimParams::none) {
+            uint64_t large = RoundUp(size, SimParams::pageSize);
+            _footprint -= large;
+            _allocated -= large;
+            return;
+        }
+        uint32_t c = _slabs[s]._class;
+        _allocated -= _classes[c]._size;
+        if (_cacheLimit > 0) {
+            std::vector<uint32_t> &cache = Cache(threadId, c);
+            cache.push_back(s);
+            if (cache.size() > _cacheLimit) {
+                while (cache.size() > _cacheLimit / 2) {
+                    ReturnSlot(cache.back());
+                    cache.pop_back();
+                }
+            }
+            return;
+        }
+        ReturnSlot(s);
+    }
+
+private:
+    struct Slab {
+        uint32_t _class, _live;
+        bool _released;
+    };
+
+    struct SizeClass {
+        uint32_t _size, _perSlab;
+        uint64_t _slabBytes;
+        // Slabs with at least one free slot. Released slabs are removed
+        // lazily when they reach the top.
+        //
+        std::vector<uint32_t> _partial;
+    };
+
+    uint32_t TakeSlot(uint32_t c) {
+        SizeClass &sc = _classes[c];
+        while (!sc._partial.empty() && _slabs[sc._partial.back()]._released) {
+            sc._partial.pop_back();
+        }
+        if (sc._partial.empty()) {
+            Slab slab = { c, 0, false };
+            sc._partial.push_back(_slabs.size());
+            _slabs.push_back(slab);
+            _footprint += sc._slabBytes;
+        }
+        uint32_t s = sc._partial.back();
+        if (++_slabs[s]._live == sc._perSlab) {
+            sc._partial.pop_back();
+        }
+        return s;
+    }
+
+    void ReturnSlot(uint32_t s) {
+        Slab &slab = _slabs[s];
+        SizeClass &sc = _classes[slab._class];
+        slab._live--;
+        if (slab._live == 0) {
+            slab._released = true;
+            _footprint -= sc._slabBytes;
+        } else if (slab._live == sc._perSlab - 1) { // It was full until now
+            sc._partial.push_back(s);
+        }
+    }
+
+    std::vector<uint32_t> &Cache(uint32_t threadId, uint32_t c) {
+        if (threadId >= _caches.size()) {
+            _caches.resize(threadId + 1);
+        }
+        if (_caches[threadId].empty()) {
+            _caches[threadId].resize(_classes.size());
+        }
+        return _caches[threadId][c];
+    }
+
+    size_t _cacheLimit;
+    uint32_t _maxClass;
+    std::vector<uint16_t> _classIndex;
+    std::vector<uint32_t> _objSlab;
+    std::vector<Slab> _slabs;
+    std::vector<SizeClass> _classes;
+    std::vector<std::vector<std::vector<uint32_t> > > _caches;
+};
+
+class BumpArenaModel : public Model {
+public:
+    BumpArenaModel(std::string name, const std::vector<uint32_t> &sizes, uint64_t regionSize) :
+        Model(name, sizes),
+        _regionSize(regionSize),
+        _objRegion(sizes.size(), SimParams::none) { }
+
+    void Malloc(uint32_t id, uint32_t size, uint32_t threadId) {
+        uint64_t sz = RoundUp(std::max(size, (uint32_t) 1), SimParams::alignment);
+        if (sz > _regionSize) {
+            uint64_t large = RoundUp(size, SimParams::pageSize);
+            _footprint += large;
+            _allocated += large;
+            return;
+        }
+        if (threadId >= _current.size()) {
+            _current.resize(threadId + 1, SimParams::none);
+        }
+        uint32_t r = _current[threadId];
+        if (r == SimParams::none || _regions[r]._used + sz > _regionSize) {
+            // The old region stays around until its last object is freed
+            //
+            if (r != SimParams::none && _regions[r]._live == 0) {
+                Release(r);
+            }
+            Region region = { 0, 0, threadId, false };
+            r = _regions.size();
+            _regions.push_back(region);
+            _current[threadId] = r;
+            _footprint += _regionSize;
+        }
+        _regions[r]._used += sz;
+        _regions[r]._live++;
+        _allocated += sz;
+        _objRegion[id] = r;
+    }
+
+    void Free(uint32_t id, uint32_t size, uint32_t threadId) {
+        uint32_t r = _objRegion[id];
+        if (r == SimParams::none) {
+            uint64_t large = RoundUp(size, SimParams::pageSize);
+            _footprint -= large;
+            _allocated -= large;
+            return;
+        }
+        Region &region = _regions[r];
+        _allocated -= RoundUp(std::max(size, (uint32_t) 1), SimParams::alignment);
+        if (--region._live > 0) {
+            return;
+        }
+        // Reset the region once it's empty. Its owner keeps bumping into
+        // it, anything else goes back to the OS.
+        //
+        if (_current[region._threadId] == r) {
+            region._used = 0;
+        } else {
+            Release(r);
+        }
+    }
+
+private:
+    struct Region {
+        uint64_t _used;
+        uint32_t _live, _threadId;
+        bool _released;
+    };
+
+    void Release(uint32_t r) {
+        _regions[r]._released = true;
+        _footprint -= _regionSize;
+    }
+
+    uint64_t _regionSize;
+    std::vector<uint32_t> _objRegion, _current;
+    std::vector<Region> _regions;
+};
+
+class BestFitModel : public Model {
+public:
+    BestFitModel(std::string name, const std::vector<uint32_t> &sizes) :
+        Model(name, sizes),
+        _top(0),
+        _objAddr(sizes.size()) { }
+
+    void Malloc(uint32_t id, uint32_t size, uint32_t threadId) {
+        uint64_t sz = RoundUp(std::max(size, (uint32_t) 1), SimParams::alignment);
+        auto it = _bySize.lower_bound(std::make_pair(sz, (uint64_t) 0));
+        if (it != _bySize.end()) {
+            uint64_t addr = it->second, hole = it->first;
+            RemoveHole(addr, hole);
+            if (hole > sz) {
+                AddHole(addr + sz, hole - sz);
+            }
+            _objAddr[id] = addr;
+        } else {
+            _objAddr[id] = _top;
+            SetTop(_top + sz);
+        }
+        _allocated += sz;
+    }
+
+    void Free(uint32_t id, uint32_t size, uint32_t threadId) {
+        uint64_t sz = RoundUp(std::max(size, (uint32_t) 1), SimParams::alignment);
+        uint64_t addr = _objAddr[id];
+        _allocated -= sz;
+
+        // Coalesce with the holes on either side
+        //
+        auto next = _byAddr.find(addr + sz);
+        if (next != _byAddr.end()) {
+            sz += next->second;
+            RemoveHole(next->first, next->second);
+        }
+        auto prev = _byAddr.lower_bound(addr);
+        if (prev != _byAddr.begin()) {
+            prev--;
+            if (prev->first + prev->second == addr) {
+                addr = prev->first;
+                sz += prev->second;
+                RemoveHole(prev->first, prev->second);
+            }
+        }
+        if (addr + sz == _top) {
+            SetTop(addr);
+        } else {
+            AddHole(addr, sz);
+        }
+    }
+
+private:
+    void AddHole(uint64_t addr, uint64_t size) {
+        _byAddr[addr] = size;
+        _bySize.insert(std::make_pair(size, addr));
+    }
+
+    void RemoveHole(uint64_t addr, uint64_t size) {
+        _byAddr.erase(addr);
+        _bySize.erase(std::make_pair(size, addr));
+    }
+
+    void SetTop(uint64_t top) {
+        _top = top;
+        _footprint = RoundUp(_top, SimParams::pageSize);
+    }
+
+    uint64_t _top;
+    std::vector<uint64_t> _objAddr;
+    std::map<uint64_t,uint64_t> _byAddr;
+    std::set<std::pair<uint64_t,uint64_t> > _bySize;
+};
+
+// Turn the trace into Ops. Frees of objects that weren't allocated while
+// tracing are dropped.
+//
+void BuildOps(TraceRecord *records, size_t length, std::vector<Op> *ops, std::vector<uint32_t> *sizes) {
+    std::unordered_map<uint64_t,uint32_t> live;
+    live.reserve(1 << 20);
+    for (size_t i = 0; i < length; i++) {
+        const TraceRecord &r = records[i];
+        if (r._action == E_MALLOC) {
+            Op op = { (uint32_t) sizes->size(), r._threadId, false };
+            live[r._addr] = op._id;
+            sizes->push_back(r._size);
+            ops->push_back(op);
+        } else if (r._action == E_FREE) {
+            auto it = live.find(r._addr);
+            if (it == live.end()) {
+                continue;
+            }
+            Op op = { it->second, r._threadId, true };
+            live.erase(it);
+            ops->push_back(op);
+        }
+    }
+}
+
+bool ParseClasses(std::string spec, std::vector<uint32_t> *classes) {
+    std::stringstream ss(spec);
+    std::string item;
+    while (std::getline(ss, item, ',')) {
+        if (item.empty()) {
+            continue;
+        }
+        classes->push_back(strtoul(item.c_str(), nullptr, 10));
+        if (classes->back() == 0) {
+            return false;
+        }
+    }
+    std::sort(classes->begin(), classes->end());
+    classes->erase(std::unique(classes->begin(), classes->end()), classes->end());
+    // Sizes are mapped to classes with a lookup table, so keep it small
+    //
+    return !classes->empty() && classes->back() <= (1 << 20);
+}
+
+void Usage(char *prog) {
+    fprintf(stderr, "usage: %s [-i trace.bin] [-m seg,tcache,bump,bestfit] [-c classes]... "
+                    "[-C classes_file] [-s slab_bytes] [-k cache_limit] [-r region_bytes] "
+                    "[-n sample_interval] [-t timeline.csv] [-j threads]\n", prog);
+    fprintf(stderr, "\t-c may be given several times, and every line of -C is another "
+                    "comma-separated list of size classes to sweep\n");
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[]) {
+    std::string input = "../src/heapshark.bin", modelSpec = "seg,tcache,bump,bestfit", timelinePath;
+    std::vector<std::vector<uint32_t> > tables;
+    uint64_t slabSize = 65536, regionSize = 1 << 20;
+    size_t cacheLimit = 64, interval = 65536, numThreads = std::thread::hardware_concurrency();
+    int opt;
+
+    while ((opt = getopt(argc, argv, "hi:m:c:C:s:k:r:n:t:j:")) != -1) {
+        std::vector<uint32_t> classes;
+        std::ifstream classFile;
+        std::string line;
+        switch (opt) {
+            case 'i': input = optarg; break;
+            case 'm': modelSpec = optarg; break;
+            case 'c':
+                if (!ParseClasses(optarg, &classes)) {
+                    Usage(argv[0]);
+                }
+                tables.push_back(classes);
+                break;
+            case 'C':
+                classFile.open(optarg);
+                if (!classFile) {
+                    fprintf(stderr, "ERROR: unable to open %s\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                while (std::getline(classFile, line)) {
+                    classes.clear();
+                    if (line.empty() || line[0] == '#') {
+                        continue;
+                    }
+                    if (!ParseClasses(line, &classes)) {
+                        Usage(argv[0]);
+                    }
+                    tables.push_back(classes);
+                }
+                break;
+            case 's': slabSize = strtoull(optarg, nullptr, 10); break;
+            case 'k': cacheLimit = strtoull(optarg, nullptr, 10); break;
+            case 'r': regionSize = strtoull(optarg, nullptr, 10); break;
+            case 'n': interval = std::max(strtoull(optarg, nullptr, 10), 1ULL); break;
+            case 't': timelinePath = optarg; break;
+            case 'j': numThreads = std::max(strtoull(optarg, nullptr, 10), 1ULL); break;
+            default: Usage(argv[0]);
+        }
+    }
+    if (tables.empty()) {
+        // Roughly the classes of jemalloc: four per doubling
+        //
+        std::vector<uint32_t> classes = { 8, 16, 32, 48, 64, 80, 96, 112, 128 };
+        for (uint32_t base = 128; base < 16384; base *= 2) {
+            for (uint32_t k = 1; k <= 4; k++) {
+                classes.push_back(base + k * base / 4);
+            }
+        }
+        tables.push_back(classes);
+    }
+    numThreads = std::max(numThreads, (size_t) 1);
+
+    // Fetch records and reduce them to mallocs and frees
+    //
+    TraceRecord *records;
+    size_t length;
+    std::vector<Op> ops;
+    std::vector<uint32_t> sizes;
+    parseRecordsAsArray(input, &records, &length);
+    BuildOps(records, length, &ops, &sizes);
+    if (length > 0) {
+        munmap(records, length * sizeof(TraceRecord));
+    }
+
+    std::vector<Model*> models;
+    std::vector<int> tableOf; // Which size-class table each seg model uses
+    std::stringstream ss(modelSpec);
+    std::string name;
+    while (std::getline(ss, name, ',')) {
+        if (name == "seg" || name == "tcache") {
+            for (size_t t = 0; t < tables.size(); t++) {
+                models.push_back(new SegregatedModel(name + "[" + std::to_string(t) + "]", sizes, tables[t],
+                                                     slabSize, name == "tcache" ? cacheLimit : 0));
+                tableOf.push_back(name == "seg" ? t : -1);
+            }
+        } else if (name == "bump") {
+            models.push_back(new BumpArenaModel(name, sizes, regionSize));
+            tableOf.push_back(-1);
+        } else if (name == "bestfit") {
+            models.push_back(new BestFitModel(name, sizes));
+            tableOf.push_back(-1);
+        } else {
+            Usage(argv[0]);
+        }
+    }
+
+    // Models are independent, so run as many of them at once as we can
+    //
+    for (size_t i = 0; i < models.size(); i += numThreads) {
+        std::vector<std::thread> threads;
+        for (size_t j = i; j < std::min(i + numThreads, models.size()); j++) {
+            threads.push_back(std::thread(&Model::Run, models[j], std::cref(ops), interval, !timelinePath.empty()));
+        }
+        for (size_t j = 0; j < threads.size(); j++) {
+            threads[j].join();
+        }
+    }
+
+    printf("%lu mallocs and frees\n", ops.size());
+    printf("%-12s %16s %16s %10s %10s %10s\n", "model", "peakFootprint", "peakRequested",
+            "internal", "external", "avgUtil");
+    int best = -1;
+    for (size_t i = 0; i < models.size(); i++) {
+        Model *m = models[i];
+        double peak = m->_peakFootprint > 0 ? (double) m->_peakFootprint : 1.0;
+        printf("%-12s %16lu %16lu %9.2f%% %9.2f%% %9.2f%%\n",
+                m->_name.c_str(),
+                m->_peakFootprint,
+                m->_peakRequested,
+                100.0 * (m->_allocatedAtPeak - m->_requestedAtPeak) / peak,
+                100.0 * (m->_peakFootprint - m->_allocatedAtPeak) / peak,
+                m->_numSamples > 0 ? 100.0 * m->_utilizationSum / m->_numSamples : 0.0);
+        if (tableOf[i] != -1 && (best == -1 || m->_peakFootprint < models[best]->_peakFootprint)) {
+            best = i;
+        }
+    }
+    if (best != -1 && tables.size() > 1) {
+        size_t t = tableOf[best];
+        printf("\nLowest peak footprint with seg: table %lu\n\t", t);
+        for (size_t i = 0; i < tables[t].size(); i++) {
+            printf(i + 1 < tables[t].size() ? "%u," : "%u\n", tables[t][i]);
+        }
+    }
+
+    if (!timelinePath.empty()) {
+        std::ofstream timeline(timelinePath.c_str());
+        timeline << "model,op,requested,allocated,footprint\n";
+        for (size_t i = 0; i < models.size(); i++) {
+            for (size_t j = 0; j < models[i]->_timeline.size(); j++) {
+                const Sample &s = models[i]->_timeline[j];
+                timeline << models[i]->_name << "," << s._op << "," << s._requested << ","
+                         << s._allocated << "," << s._footprint << "\n";
+            }
+        }
+    }
+
+    for (size_t i = 0; i < models.size(); i++) {
+        delete models[i];
+    }
+    return 0;
+}
@@ -0,0 +1,475 @@
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+#include <map>
+#include <set>
+#include <fstream>
+#include <algorithm>
+#include <queue>
+#include <unordered_map>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "record.hpp"
+#include "ring.hpp"
+
+// fieldheat maps every sampled heap access to the object it landed in and
+// to the offset inside that object, and keeps per-site histograms of
+// those offsets, split by reads and writes and by thread. From them it
+// points out sites whose objects are worth splitting into hot and cold
+// parts and cache lines whose fields are written by different threads.
+//
+// Records are consumed one at a time, so the same analysis works on a
+// binary trace (-i) or on a ring that HeapShark is streaming into (-r),
+// and memory only grows with the number of live objects and sites. A
+// binary trace is already in timestamp order. Threads push to the ring a
+// batch at a time, so records from the ring are put back in timestamp
+// order within a window of -w records per process and image first. Records further apart than
+// that are still seen out of order, e.g. an access before the malloc of
+// its object, so results from -r are approximate unless the window is
+// larger than HeapShark's batch size (-rb) times the number of threads.
+//
+// Offsets are grouped into buckets of -g bytes (8 by default). Cache
+// lines are real, 64-byte aligned lines, so where an object starts within
+// its first line decides which of its fields share a line. Lines are
+// reported per starting offset, counted from the object's first line.
+//
+
+namespace HeatParams {
+    size_t granularity = 8;
+    size_t maxOffset = 4096; // Accesses past this offset are counted, but not placed
+    const size_t cacheLine = 64;
+    const uint32_t none = UINT32_MAX;
+    const uint32_t several = UINT32_MAX - 1;
+    const double hotFraction = 0.9;
+};
+
+struct Bucket {
+    Bucket() : _reads(0), _writes(0) { }
+    uint64_t _reads, _writes;
+};
+
+// Writes to a bucket of an object that another thread had already
+// written (true sharing), and writes while another thread had written a
+// different bucket on the same line of the same object (false sharing)
+//
+struct LineHeat {
+    LineHeat() : _sharedWrites(0), _falseSharing(0) { }
+    uint64_t _sharedWrites, _falseSharing;
+    std::set<size_t> _sharedBuckets, _falseBuckets;
+};
+
+struct SiteHeat {
+    SiteHeat() : _objects(0), _reads(0), _writes(0), _unplaced(0), _maxSize(0) { }
+    uint64_t _objects, _reads, _writes, _unplaced;
+    uint32_t _maxSize;
+    std::vector<Bucket> _buckets;
+    // Reads and writes per bucket for each thread, interleaved
+    //
+    std::unordered_map<uint32_t,std::vector<uint64_t> > _threads;
+    // Keyed by where objects start within a cache line, then by line of
+    // the object
+    //
+    std::map<std::pair<size_t,size_t>,LineHeat> _lines;
+};
+
+struct Object {
+    uint32_t _size;
+    uint64_t _site;
+    size_t _align; // Offset of the object within its first cache line
+    // The thread that has written each bucket of this object, none or
+    // several. Only grows as far as the object is written.
+    //
+    std::vector<uint32_t> _writers;
+};
+
+class FieldHeat {
+public:
+    FieldHeat() : _heapAccesses(0), _otherAccesses(0) { }
+
+    // Live objects are kept per pid. When a process execs, the objects of
+    // its previous image are gone, and any record of that image that
+    // still shows up is ignored.
+    //
+    void Consume(const TraceRecord &r) {
+        auto image = _images.find(r._pid);
+        if (image == _images.end()) {
+            _images[r._pid] = r._image;
+        } else if (r._image < image->second) {
+            return;
+        } else if (r._image > image->second) {
+            _live.erase(_live.lower_bound(std::make_pair(r._pid, (uint64_t) 0)),
+                        _live.upper_bound(std::make_pair(r._pid, UINT64_MAX)));
+            image->second = r._image;
+        }
+        if (r._action == E_MALLOC) {
+            Object &o = _live[std::make_pair(r._pid, r._addr)];
+            o._size = r._size;
+            o._site = r._site;
+            o._align = r._addr % HeatParams::cacheLine;
+            o._writers.clear();
+            SiteHeat &s = _sites[r._site];
+            s._objects++;
+            s._maxSize = std::max(s._maxSize, r._size);
+        } else if (r._action == E_FREE) {
+            _live.erase(std::make_pair(r._pid, r._addr));
+        } else {
+            Access(r);
+        }
+    }
+
+    // names maps site hashes to backtraces, when they're known
+    //
+    void Report(FILE *out, size_t numSites, const std::unordered_map<uint64_t,std::string> &names) {
+        std::vector<std::pair<uint64_t,SiteHeat*> > sites;
+        for (auto it = _sites.begin(); it != _sites.end(); it++) {
+            if (it->second._reads + it->second._writes > 0) {
+                sites.push_back(std::make_pair(it->first, &(it->second)));
+            }
+        }
+        std::sort(sites.begin(), sites.end(),
+            [](const std::pair<uint64_t,SiteHeat*> &a, const std::pair<uint64_t,SiteHeat*> &b) {
+                return a.second->_reads + a.second->_writes > b.second->_reads + b.second->_writes;
+            });
+
+        fprintf(out, "heapAccesses: %lu, otherAccesses: %lu\n", _heapAccesses, _otherAccesses);
+        for (size_t i = 0; i < std::min(numSites, sites.size()); i++) {
+            auto name = names.find(sites[i].first);
+            ReportSite(out, sites[i].first, *(sites[i].second),
+                       name == names.end() ? nullptr : name->second.c_str());
+        }
+    }
+
+    // One row per site, thread and bucket that was accessed
+    //
+    void WriteCSV(std::ofstream &csv) {
+        csv << "site,tid,offset,reads,writes\n";
+        for (auto it = _sites.begin(); it != _sites.end(); it++) {
+            for (auto t = it->second._threads.begin(); t != it->second._threads.end(); t++) {
+                for (size_t b = 0; b < t->second.size() / 2; b++) {
+                    if (t->second[2 * b] + t->second[2 * b + 1] == 0) {
+                        continue;
+                    }
+                    csv << it->first << "," << t->first << "," << b * HeatParams::granularity << ","
+                        << t->second[2 * b] << "," << t->second[2 * b + 1] << "\n";
+                }
+            }
+        }
+    }
+
+private:
+    void Access(const TraceRecord &r) {
+        auto it = _live.upper_bound(std::make_pair(r._pid, r._addr));
+        if (it == _live.begin()) {
+            _otherAccesses++;
+            return;
+        }
+        it--;
+        uint64_t offset = r._addr - it->first.second;
+        if (it->first.first != r._pid || offset >= it->second._size) {
+            _otherAccesses++;
+            return;
+        }
+        _heapAccesses++;
+
+        bool write = r._action == E_WRITE;
+        Object &o = it->second;
+        SiteHeat &s = _sites[o._site];
+        if (write) {
+            s._writes++;
+        } else {
+            s._reads++;
+        }
+        if (offset >= HeatParams::maxOffset) {
+            s._unplaced++;
+            return;
+        }
+
+        size_t b = offset / HeatParams::granularity;
+        if (b >= s._buckets.size()) {
+            s._buckets.resize(b + 1);
+        }
+        Bucket &bucket = s._buckets[b];
+        std::vector<uint64_t> &hist = s._threads[r._threadId];
+        if (2 * b >= hist.size()) {
+            hist.resize(2 * (b + 1));
+        }
+        if (write) {
+            bucket._writes++;
+            hist[2 * b + 1]++;
+            Write(o, s, b, r._threadId);
+        } else {
+            bucket._reads++;
+            hist[2 * b]++;
+        }
+    }
+
+    // Writers are tracked per object, so objects that are each private to
+    // one thread never conflict, however many threads allocate from the
+    // same site. Buckets are on the same line when their first bytes are.
+    //
+    void Write(Object &o, SiteHeat &s, size_t b, uint32_t threadId) {
+        const size_t g = HeatParams::granularity;
+        const size_t perLine = std::max(HeatParams::cacheLine / g, (size_t) 1);
+        if (b >= o._writers.size()) {
+            o._writers.resize(b + 1, HeatParams::none);
+        }
+        uint32_t &writer = o._writers[b];
+        if (writer == HeatParams::none) {
+            writer = threadId;
+        } else if (writer != threadId) {
+            writer = HeatParams::several;
+        }
+        size_t line = (o._align + b * g) / HeatParams::cacheLine;
+        LineHeat *heat = nullptr;
+        if (writer == HeatParams::several) {
+            heat = &(s._lines[std::make_pair(o._align, line)]);
+            heat->_sharedWrites++;
+            heat->_sharedBuckets.insert(b);
+        }
+        bool conflict = false;
+        size_t last = std::min(b + perLine + 1, o._writers.size());
+        for (size_t c = b >= perLine ? b - perLine : 0; c < last; c++) {
+            if (c == b || (o._align + c * g) / HeatParams::cacheLine != line || 
+                    o._writers[c] == HeatParams::none || o._writers[c] == threadId) {
+                continue;
+            }
+            if (heat == nullptr) {
+                heat = &(s._lines[std::make_pair(o._align, line)]);
+            }
+            heat->_falseBuckets.insert(c);
+            conflict = true;
+        }
+        if (conflict) {
+            heat->_falseSharing++;
+            heat->_falseBuckets.insert(b);
+        }
+    }
+
+    void ReportSite(FILE *out, uint64_t site, SiteHeat &s, const char *backtrace) {
+        const size_t g = HeatParams::granularity;
+        uint64_t total = s._reads + s._writes;
+        fprintf(out, "\nsite %lu: %lu objects of up to %u bytes, %lu reads, %lu writes",
+                site, s._objects, s._maxSize, s._reads, s._writes);
+        if (s._unplaced > 0) {
+            fprintf(out, " (%lu past offset %lu)", s._unplaced, HeatParams::maxOffset);
+        }
+        if (backtrace != nullptr) {
+            fprintf(out, "\n\tbacktrace: %s", backtrace);
+        }
+        fprintf(out, "\n\t%-12s %12s %12s %8s\n", "offset", "reads", "writes", "threads");
+        for (size_t b = 0; b < s._buckets.size(); b++) {
+            const Bucket &bucket = s._buckets[b];
+            if (bucket._reads + bucket._writes == 0) {
+                continue;
+            }
+            size_t threads = 0;
+            for (auto t = s._threads.begin(); t != s._threads.end(); t++) {
+                if (2 * b < t->second.size() && t->second[2 * b] + t->second[2 * b + 1] > 0) {
+                    threads++;
+                }
+            }
+            fprintf(out, "\t%5lu-%-6lu %12lu %12lu %8lu\n",
+                    b * g, b * g + g - 1, bucket._reads, bucket._writes, threads);
+        }
+
+        // The hot part of an object is the fewest buckets that account for
+        // hotFraction of its accesses. Splitting is only worth suggesting
+        // when that leaves at least a cache line of cold data behind.
+        //
+        std::vector<size_t> order;
+        for (size_t b = 0; b < s._buckets.size(); b++) {
+            order.push_back(b);
+        }
+        std::sort(order.begin(), order.end(), [&s](size_t a, size_t b) {
+            return s._buckets[a]._reads + s._buckets[a]._writes > s._buckets[b]._reads + s._buckets[b]._writes;
+        });
+        uint64_t covered = 0;
+        std::set<size_t> hot;
+        for (size_t i = 0; i < order.size() && covered < HeatParams::hotFraction * total; i++) {
+            covered += s._buckets[order[i]]._reads + s._buckets[order[i]]._writes;
+            hot.insert(order[i]);
+        }
+        size_t objectBytes = std::min((size_t) s._maxSize, HeatParams::maxOffset);
+        size_t hotBytes = hot.size() * g;
+        if (s._unplaced == 0 && objectBytes >= hotBytes + HeatParams::cacheLine) {
+            fprintf(out, "\thot/cold split candidate: %.0f%% of accesses go to %lu of %lu bytes:",
+                    100.0 * covered / total, hotBytes, objectBytes);
+            for (auto it = hot.begin(); it != hot.end(); it++) {
+                fprintf(out, " %lu-%lu", *it * g, *it * g + g - 1);
+            }
+            fprintf(out, "\n");
+        }
+
+        // A line is a false sharing candidate when threads wrote different
+        // fields of it in the same object. Fields that several threads wrote
+        // in the same object are true sharing and are reported separately.
+        //
+        for (auto it = s._lines.begin(); it != s._lines.end(); it++) {
+            size_t align = it->first.first, line = it->first.second;
+            const LineHeat &heat = it->second;
+            size_t first = line * HeatParams::cacheLine > align ? line * HeatParams::cacheLine - align : 0;
+            fprintf(out, "\tline %lu of objects starting %lu bytes into a line (bytes %lu-%lu): ",
+                    line, align, first, (line + 1) * HeatParams::cacheLine - align - 1);
+            const std::set<size_t> *buckets = &(heat._falseBuckets);
+            if (heat._falseSharing > 0) {
+                fprintf(out, "false sharing candidate, %lu conflicting writes:", heat._falseSharing);
+            } else {
+                fprintf(out, "written by several threads, %lu shared writes:", heat._sharedWrites);
+                buckets = &(heat._sharedBuckets);
+            }
+            for (auto b = buckets->begin(); b != buckets->end(); b++) {
+                fprintf(out, " %lu-%lu", *b * g, *b * g + g - 1);
+            }
+            fprintf(out, "\n");
+        }
+    }
+
+    uint64_t _heapAccesses, _otherAccesses;
+    std::map<std::pair<uint32_t,uint64_t>,Object> _live; // Keyed by (pid, address)
+    std::unordered_map<uint32_t,uint16_t> _images;
+    std::unordered_map<uint64_t,SiteHeat> _sites;
+};
+
+// Hold back records until the window is full, then release them oldest
+// first. Timestamps only compare within one image of one process, so
+// every (pid, image) has a window of its own, and a process's previous
+// image is released in full as soon as it execs. Records with the same
+// timestamp are released in the order they arrived, which keeps each
+// thread's program order.
+//
+class ReorderWindow {
+public:
+    ReorderWindow(FieldHeat &heat, size_t size) : _heat(heat), _size(size), _arrivals(0) { }
+
+    void Push(const TraceRecord &r) {
+        uint64_t key = Key(r._pid, r._image);
+        auto first = _streams.lower_bound(Key(r._pid, 0));
+        while (first != _streams.end() && first->first < key && (first->first >> 16) == r._pid) {
+            Drain(first->second);
+            first = _streams.erase(first);
+        }
+        Queue &pending = _streams[key];
+        Pending p = { r, _arrivals++ };
+        pending.push(p);
+        if (pending.size() > _size) {
+            Release(pending);
+        }
+    }
+
+    void Flush() {
+        for (auto it = _streams.begin(); it != _streams.end(); it++) {
+            Drain(it->second);
+        }
+        _streams.clear();
+    }
+
+private:
+    struct Pending {
+        TraceRecord _record;
+        uint64_t _arrival;
+    };
+
+    struct Later {
+        bool operator()(const Pending &a, const Pending &b) const {
+            if (a._record._timestamp != b._record._timestamp) {
+                return a._record._timestamp > b._record._timestamp;
+            }
+            return a._arrival > b._arrival;
+        }
+    };
+
+    typedef std::priority_queue<Pending,std::vector<Pending>,Later> Queue;
+
+    static uint64_t Key(uint32_t pid, uint16_t image) {
+        return ((uint64_t) pid << 16) | image;
+    }
+
+    void Release(Queue &pending) {
+        _heat.Consume(pending.top()._record);
+        pending.pop();
+    }
+
+    void Drain(Queue &pending) {
+        while (!pending.empty()) {
+            Release(pending);
+        }
+    }
+
+    FieldHeat &_heat;
+    size_t _size;
+    uint64_t _arrivals;
+    std::map<uint64_t,Queue> _streams; // Keyed by pid and image
+};
+
+void Usage(char *prog) {
+    fprintf(stderr, "usage: %s [-i trace.bin | -r ring_name] [-g granularity] [-m max_offset] "
+                    "[-n num_sites] [-c heat.csv] [-w window]\n", prog);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[]) {
+    std::string input = "../src/heapshark.bin", ringName, csvPath;
+    size_t numSites = 10, window = 1048576;
+    FieldHeat heat;
+    std::unordered_map<uint64_t,std::string> names;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "i:r:g:m:n:c:w:")) != -1) {
+        switch (opt) {
+            case 'i': input = optarg; break;
+            case 'r': ringName = optarg; break;
+            case 'g': HeatParams::granularity = strtoul(optarg, nullptr, 10); break;
+            case 'm': HeatParams::maxOffset = strtoul(optarg, nullptr, 10); break;
+            case 'n': numSites = strtoul(optarg, nullptr, 10); break;
+            case 'c': csvPath = optarg; break;
+            case 'w': window = strtoul(optarg, nullptr, 10); break;
+            default: Usage(argv[0]);
+        }
+    }
+    if (HeatParams::granularity == 0) {
+        Usage(argv[0]);
+    }
+
+    if (ringName.empty()) {
+        TraceRecord *records;
+        size_t length;
+        parseRecordsAsArray(input, &records, &length);
+        for (size_t i = 0; i < length; i++) {
+            heat.Consume(records[i]);
+        }
+        if (length > 0) {
+            munmap(records, length * sizeof(TraceRecord));
+        }
+    } else {
+        SharedRing *ring;
+        TraceRecord r;
+        ReorderWindow reorder(heat, window);
+        while ((ring = SharedRing::Attach(ringName)) == nullptr) {
+            usleep(10000);
+        }
+        for (;;) {
+            if (ring->TryPop(&r)) {
+                reorder.Push(r);
+            } else if (!ring->HasProducers()) {
+                while (ring->TryPop(&r)) {
+                    reorder.Push(r);
+                }
+                reorder.Flush();
+                ring->ReadSites(&names);
+                break;
+            } else {
+                usleep(1000);
+            }
+        }
+        delete ring;
+        SharedRing::Unlink(ringName);
+    }
+
+    heat.Report(stdout, numSites, names);
+    if (!csvPath.empty()) {
+        std::ofstream csv(csvPath.c_str());
+        heat.WriteCSV(csv);
+    }
+    return 0;
+}
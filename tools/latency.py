@@ -0,0 +1,76 @@
+import json, sys, argparse
+
+# Summarize the cycles spent in allocation entry points, as measured
+# by HeapShark with -l. Calls are recorded with the cost of HeapShark's
+# own hooks included, so the overhead it calibrated is subtracted from
+# each of them here.
+#
+
+# Estimate a percentile from a histogram of powers of two, assuming
+# that calls are spread evenly within each bucket
+#
+def percentile(hist, count, p):
+    target = p * count
+    seen = 0
+    for i, n in enumerate(hist):
+        if seen + n >= target and n > 0:
+            low = 0 if i == 0 else 2 ** i
+            return low + (2 ** (i + 1) - low) * (target - seen) / n
+        seen += n
+    return 0
+
+def frames(backtrace):
+    return ' <- '.join('(NIL)' if y['path'] == '' else y['path'] + ':' + str(y['line']) for y in backtrace)
+
+parser = argparse.ArgumentParser()
+parser.add_argument('--input', type = str, help = 'The path to the output file generated by HeapShark')
+parser.add_argument('--threads', action = 'store_true', help = 'Report each thread separately')
+parser.add_argument('--top', type = int, default = 10, help = 'Number of sites to report')
+args = parser.parse_args()
+json_file = '../src/heapshark.json'
+if(args.input != None):
+    json_file = args.input
+
+with open(json_file, 'r') as f:
+    data = json.load(f)
+
+if 'latency' not in data:
+    print('No latency data, run HeapShark with -l')
+    sys.exit()
+latency = data['latency']
+overhead = latency['overhead']
+
+# Merge threads unless asked not to
+#
+calls = {}
+for x in latency['calls']:
+    key = (x['site'], x['entry'], x['tid'] if args.threads else None)
+    if key not in calls:
+        calls[key] = {'backtrace': x['backtrace'], 'count': 0, 'total': 0, 'max': 0, 'hist': []}
+    c = calls[key]
+    c['count'] += x['count']
+    c['total'] += x['total']
+    c['max'] = max(c['max'], x['max'])
+    if len(x['hist']) > len(c['hist']):
+        c['hist'] += [0] * (len(x['hist']) - len(c['hist']))
+    for i, n in enumerate(x['hist']):
+        c['hist'][i] += n
+
+print('HeapShark overhead subtracted from each call: ' + str(overhead) + ' cycles\n')
+for key, c in sorted(calls.items(), key = lambda kv: kv[1]['total'], reverse = True)[:args.top]:
+    site, entry, tid = key
+    header = entry.upper() + ' at ' + frames(c['backtrace'])
+    if tid != None:
+        header += ' (thread ' + str(tid) + ')'
+    print(header)
+    print('\tCalls: ' + str(c['count']))
+    # Every call includes the overhead once. Clamp at 0 in case a call
+    # was measured faster than the calibration.
+    #
+    top = max(c['max'] - overhead, 0)
+    p50 = max(min(int(percentile(c['hist'], c['count'], 0.5)), c['max']) - overhead, 0)
+    p99 = max(min(int(percentile(c['hist'], c['count'], 0.99)), c['max']) - overhead, 0)
+    total = max(c['total'] - c['count'] * overhead, 0)
+    print('\tTotal cycles: ' + str(total))
+    print('\tMean cycles: ' + str(total // c['count']))
+    print('\tp50/p99/max cycles: ' + str(p50) + '/' + str(p99) + '/' + str(top))
@@ -0,0 +1,147 @@
+import json, sys, os, glob, struct, argparse
+from multiprocessing import Pool
+
+# Merge or compare the traces that HeapShark writes for each process
+# (and each exec'd image) when the traced program forks or execs. The
+# traces of a run are <output>, <output>.<pid> and <output>.<pid>.<image>.
+#
+
+# Layout of a TraceRecord in a binary trace written with -b
+#
+RECORD = struct.Struct('<QQQIIIHBx')
+
+def read_binary(path, json_file):
+    # Relative paths are relative to where Pin ran, which is usually where
+    # the output file is too
+    #
+    if not os.path.exists(path):
+        path = os.path.join(os.path.dirname(json_file), os.path.basename(path))
+    with open(path, 'rb') as f:
+        buf = f.read()
+    return [{'type': r[7], 'addr': r[1], 'size': r[3], 'tid': r[4], 'time': r[2], 'site': r[0]}
+            for r in RECORD.iter_unpack(buf)]
+
+def summarize(events):
+    counts = [0, 0, 0, 0]
+    live = {}
+    allocated = live_bytes = peak_live_bytes = 0
+    for x in events:
+        counts[x['type']] += 1
+        if x['type'] == 0:
+            live[x['addr']] = x['size']
+            allocated += x['size']
+            live_bytes += x['size']
+            peak_live_bytes = max(peak_live_bytes, live_bytes)
+        elif x['type'] == 1 and x['addr'] in live:
+            live_bytes -= live.pop(x['addr'])
+    return {'mallocs': counts[0], 'frees': counts[1], 'reads': counts[2], 'writes': counts[3],
+            'allocated': allocated, 'peakLiveBytes': peak_live_bytes}
+
+# A process that never got to exit through Pin (e.g. it was killed, or it
+# exec'd without -follow_execv) leaves a trace with only its metadata.
+# Such traces are kept, but marked incomplete and counted as empty.
+#
+def load(args):
+    json_file, keep_events = args
+    with open(json_file, 'r') as f:
+        text = f.read()
+    complete = True
+    try:
+        data = json.loads(text)
+    except json.JSONDecodeError:
+        complete = False
+        prefix = '{"metadata":'
+        metadata = {}
+        if text.startswith(prefix):
+            try:
+                metadata = json.JSONDecoder().raw_decode(text, len(prefix))[0]
+            except json.JSONDecodeError:
+                pass
+        data = {'metadata': metadata, 'events': []}
+    metadata = data['metadata']
+    events = data['events']
+    if complete and 'binary' in metadata:
+        events = read_binary(metadata['binary'], json_file)
+    return {'file': json_file,
+            'complete': complete,
+            'metadata': metadata,
+            'summary': summarize(events),
+            'events': events if keep_events else None}
+
+def print_row(proc, depth):
+    s = proc['summary']
+    m = proc['metadata']
+    name = ('  ' * depth) + str(m.get('pid', '?'))
+    if m.get('image', 0) > 0:
+        name += ' (exec ' + str(m['image']) + ')'
+    print('%-24s %10d %10d %10d %10d %14d %14d  %s%s' % (name, s['mallocs'], s['frees'], s['reads'],
+          s['writes'], s['allocated'], s['peakLiveBytes'], proc['file'],
+          '' if proc['complete'] else ' (incomplete)'))
+
+def node(m):
+    return (m.get('pid'), m.get('image', 0))
+
+parser = argparse.ArgumentParser()
+parser.add_argument('--input', type = str, help = 'The output file given to HeapShark; every trace of the run is picked up')
+parser.add_argument('--output', type = str, help = 'Merge all events into this file instead of comparing processes')
+parser.add_argument('--jobs', type = int, default = None, help = 'Number of traces to load in parallel')
+parser.add_argument('files', nargs = '*', help = 'Traces to use instead of those found from --input')
+args = parser.parse_args()
+json_file = '../src/heapshark.json'
+if(args.input != None):
+    json_file = args.input
+
+files = args.files
+if len(files) == 0:
+    files = [f for f in [json_file] + sorted(glob.glob(json_file + '.*'))
+             if os.path.isfile(f) and not f.endswith('.follow')]
+if len(files) == 0:
+    print('No traces found for ' + json_file)
+    sys.exit()
+
+with Pool(args.jobs) as pool:
+    procs = pool.map(load, [(f, args.output != None) for f in files])
+
+# Rebuild the process tree. An exec'd image is a child of the image that
+# exec'd it, and a forked process is a child of the image its parent was
+# running when it forked.
+#
+procs.sort(key = lambda p: (p['metadata'].get('pid', 0), p['metadata'].get('image', 0)))
+nodes = set(node(p['metadata']) for p in procs)
+children = {}
+roots = []
+for p in procs:
+    m = p['metadata']
+    if m.get('image', 0) > 0:
+        parent = (m.get('pid'), m['image'] - 1)
+    else:
+        parent = (m.get('ppid'), m.get('parentImage', 0))
+    if parent in nodes and parent != node(m):
+        children.setdefault(parent, []).append(p)
+    else:
+        roots.append(p)
+
+if args.output == None:
+    print('%-24s %10s %10s %10s %10s %14s %14s  %s' % ('pid', 'mallocs', 'frees', 'reads', 'writes',
+          'allocated', 'peakLiveBytes', 'file'))
+    def visit(p, depth):
+        print_row(p, depth)
+        for c in children.get(node(p['metadata']), []):
+            visit(c, depth + 1)
+    for r in roots:
+        visit(r, 0)
+    sys.exit()
+
+# There's no clock shared between processes, so events stay grouped by
+# process and image, in the order each of them recorded them
+#
+merged = {'metadata': {'processes': []}, 'events': []}
+for p in procs:
+    m = p['metadata']
+    merged['metadata']['processes'].append(dict(m, file = p['file'], complete = p['complete']))
+    for x in p['events']:
+        x['pid'] = m.get('pid')
+        x['image'] = m.get('image', 0)
+        merged['events'].append(x)
+with open(args.output, 'w') as f:
+    json.dump(merged, f)
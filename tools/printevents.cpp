@@ -33,11 +33,11 @@ int main() {
                 fprintf(stderr, "ERROR: Invalid event\n");
                 return -1;
         }
-        printf("addr = %p, size = %u, tid = %u, time = %u\n",
+        printf("addr = %p, size = %u, tid = %u, time = %lu\n",
                 curEvent._addr,
                 curEvent._size,
                 curEvent._threadId,
-                curEvent._timestamp);
+                (unsigned long) curEvent._timestamp);
     }
     munmap(events, length * sizeof(Event));
     return 0;
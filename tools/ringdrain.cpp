@@ -0,0 +1,159 @@
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <unordered_map>
+#include <unistd.h>
+#include "record.hpp"
+#include "ring.hpp"
+
+// ringdrain attaches to the ring that HeapShark streams into (-r <name>)
+// and aggregates events while the traced program is still running. A
+// summary is printed every few seconds and once more after HeapShark
+// detaches, or dies. The backtrace of each site is read from the ring's
+// sites file as HeapShark finds new ones. Objects are tracked per
+// process, since processes that forked from one another reuse the same
+// addresses.
+//
+
+struct SiteStats {
+    SiteStats() : _mallocs(0), _frees(0), _bytes(0), _liveBytes(0) { }
+    size_t _mallocs, _frees, _bytes, _liveBytes;
+};
+
+struct Object {
+    uint64_t _site;
+    uint32_t _size;
+};
+
+static size_t stats[4], liveBytes, peakLiveBytes;
+static std::unordered_map<uint64_t,SiteStats> sites;
+// Live objects per pid. Only the latest image of each process has any,
+// since exec replaces the address space.
+//
+static std::unordered_map<uint32_t,std::unordered_map<uint64_t,Object> > liveObjects;
+static std::unordered_map<uint32_t,uint16_t> images;
+static std::unordered_map<uint64_t,std::string> siteNames;
+
+// Objects of an image that exec'd are gone without being freed
+//
+void ReleaseObjects(std::unordered_map<uint64_t,Object> &objects) {
+    for (auto it = objects.begin(); it != objects.end(); it++) {
+        sites[it->second._site]._liveBytes -= it->second._size;
+        liveBytes -= it->second._size;
+    }
+    objects.clear();
+}
+
+void Consume(const TraceRecord &r) {
+    std::unordered_map<uint64_t,Object> &objects = liveObjects[r._pid];
+    auto image = images.find(r._pid);
+    if (image == images.end()) {
+        images[r._pid] = r._image;
+    } else if (r._image > image->second) {
+        ReleaseObjects(objects);
+        image->second = r._image;
+    }
+    stats[r._action]++;
+    if (r._action == E_MALLOC) {
+        Object o = { r._site, r._size };
+        objects[r._addr] = o;
+        SiteStats &s = sites[r._site];
+        s._mallocs++;
+        s._bytes += r._size;
+        s._liveBytes += r._size;
+        liveBytes += r._size;
+        peakLiveBytes = std::max(peakLiveBytes, liveBytes);
+    } else if (r._action == E_FREE) {
+        // Frees are attributed to the site that allocated the object
+        //
+        auto it = objects.find(r._addr);
+        if (it == objects.end()) {
+            return;
+        }
+        SiteStats &s = sites[it->second._site];
+        s._frees++;
+        s._liveBytes -= it->second._size;
+        liveBytes -= it->second._size;
+        objects.erase(it);
+    }
+}
+
+void Report(SharedRing *ring) {
+    std::vector<std::pair<uint64_t,SiteStats> > top(sites.begin(), sites.end());
+    size_t n = std::min(top.size(), (size_t) 10);
+    std::partial_sort(top.begin(), top.begin() + n, top.end(),
+        [](const std::pair<uint64_t,SiteStats> &a, const std::pair<uint64_t,SiteStats> &b) {
+            return a.second._mallocs > b.second._mallocs;
+        });
+
+    printf("numMallocs: %lu, numFrees: %lu, numReads: %lu, numWrites: %lu, dropped: %lu\n",
+            stats[E_MALLOC], stats[E_FREE], stats[E_READ], stats[E_WRITE], ring->Dropped());
+    printf("liveBytes: %lu, peakLiveBytes: %lu\n", liveBytes, peakLiveBytes);
+    ring->ReadSites(&siteNames);
+    for (size_t i = 0; i < n; i++) {
+        printf("\tsite %lu: mallocs = %lu, frees = %lu, bytes = %lu, liveBytes = %lu\n",
+                top[i].first,
+                top[i].second._mallocs,
+                top[i].second._frees,
+                top[i].second._bytes,
+                top[i].second._liveBytes);
+        auto name = siteNames.find(top[i].first);
+        if (name != siteNames.end()) {
+            printf("\t\t%s\n", name->second.c_str());
+        }
+    }
+    fflush(stdout);
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 2 || argc > 3) {
+        fprintf(stderr, "usage: %s <ring_name> [report_interval_seconds]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    std::string name = argv[1];
+    time_t interval = argc == 3 ? atoi(argv[2]) : 5, lastReport;
+    SharedRing *ring;
+    TraceRecord r;
+
+    // The consumer is allowed to start before HeapShark, so wait for
+    // the ring to show up
+    //
+    while ((ring = SharedRing::Attach(name)) == nullptr) {
+        usleep(10000);
+    }
+
+    lastReport = time(nullptr);
+    for (size_t consumed = 1; ; consumed++) {
+        if (ring->TryPop(&r)) {
+            Consume(r);
+            // Only look at the clock every so often while busy
+            //
+            if (consumed % 1048576 != 0) {
+                continue;
+            }
+        } else if (!ring->HasProducers()) {
+            // HasProducers must be checked before the last attempt to pop,
+            // otherwise a batch pushed just before detaching could be missed.
+            // Batches that a dead producer never pushed are lost.
+            //
+            while (ring->TryPop(&r)) {
+                Consume(r);
+            }
+            break;
+        } else {
+            usleep(1000);
+        }
+        if (time(nullptr) - lastReport >= interval) {
+            Report(ring);
+            lastReport = time(nullptr);
+        }
+    }
+
+    Report(ring);
+    delete ring;
+    SharedRing::Unlink(name);
+    return 0;
+}